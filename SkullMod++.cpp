@@ -4,7 +4,17 @@
 #include <Windows.h>
 #include <string.h>
 #include <string>
+#include <vector>
+#include <stdexcept>
+#include <mutex>
+#include <algorithm>
 #include "gfs.h"
+#include "gfs_index.h"
+#include "batch.h"
+#include "gfs_compressed.h"
+#include "gfs_verify.h"
+#include "gbs.h"
+#include "trace.h"
 
 //-----------------------
 
@@ -23,20 +33,333 @@ int main(int argc, char* argv[])
         std::cout << "There are no files" << '\n';
         return 0;
     }
-    GFSUnpacker GFSUnpack;
-    GFSPacker GFSpack;
-    for (int i{ 1 }; i < argc; i++) {
-        std::filesystem::path fileread = argv[i];
-        std::cout << "File Read Path:" << fileread << '\n';
-        //GFS gfs(fileread);
-        
-        if (fileread.extension() == "") {
+    unsigned jobs{ 1 };
+    uint32_t metadata_reserve{ 0 };
+    uint32_t alignment{ 1 };
+    uint32_t realign{ 0 };
+    bool incremental{ false };
+    bool compare_hashes{ false };
+    bool compress{ false };
+    bool verify{ false };
+    gfs_compressed::codec compression{ gfs_compressed::codec::xpress_huff };
+    unsigned queue_depth{ 0 };
+    unsigned batch_workers{ 0 };
+    unsigned io_limit{ 0 };
+    uint64_t memory_limit{ 0 };
+    bool print_stats{ false };
+    std::filesystem::path trace_path;
+    std::vector<std::string> files_to_extract;
+    // --diff BASE TARGET PATCH and --apply BASE PATCH OUTPUT
+    std::vector<std::vector<std::filesystem::path>> diffs;
+    std::vector<std::vector<std::filesystem::path>> applies;
+    // --merge-gbs BASE_DIR SOURCE_DIR OUTPUT_DIR
+    std::vector<std::vector<std::filesystem::path>> scene_merges;
+    gbs::config merge_config{ gbs::config::None };
+    std::vector<std::filesystem::path> paths;
+    try {
+        for (int i{ 1 }; i < argc; i++) {
+            std::string arg = argv[i];
+            auto number_arg = [&](const char* what) {
+                if (i + 1 == argc) {
+                    throw std::invalid_argument(arg + " needs " + what);
+                }
+                return std::stoul(argv[++i]);
+            };
+            if (arg == "--jobs" || arg == "-j") {
+                jobs = (unsigned)number_arg("a number (0 = all cores)");
+            }
+            else if (arg == "--reserve") {
+                metadata_reserve = (uint32_t)number_arg("a size in bytes");
+            }
+            else if (arg == "--align") {
+                alignment = (uint32_t)number_arg("an alignment in bytes");
+            }
+            else if (arg == "--realign") {
+                realign = (uint32_t)number_arg("an alignment in bytes");
+            }
+            else if (arg == "--queue-depth") {
+                queue_depth = (unsigned)number_arg("a number of queued operations (0 = off)");
+            }
+            else if (arg == "--batch") {
+                batch_workers = (unsigned)number_arg("a number of archives (0 = all cores)");
+            }
+            else if (arg == "--io-limit") {
+                io_limit = (unsigned)number_arg("a number of reads and writes (0 = no limit)");
+            }
+            else if (arg == "--memory-limit") {
+                memory_limit = uint64_t(number_arg("a size in MiB (0 = no limit)")) * 1024 * 1024;
+            }
+            else if (arg == "--file") {
+                if (i + 1 == argc) {
+                    throw std::invalid_argument(arg + " needs a path inside the archive");
+                }
+                files_to_extract.push_back(argv[++i]);
+            }
+            else if (arg == "--incremental") {
+                incremental = true;
+            }
+            else if (arg == "--hash") {
+                compare_hashes = true;
+            }
+            else if (arg == "--diff" || arg == "--apply") {
+                if (i + 3 >= argc) {
+                    throw std::invalid_argument(arg + (arg == "--diff" ? " needs a base, a target and a patch path" : " needs a base, a patch and an output path"));
+                }
+                (arg == "--diff" ? diffs : applies).push_back({ argv[i + 1], argv[i + 2], argv[i + 3] });
+                i += 3;
+            }
+            else if (arg == "--merge-gbs") {
+                if (i + 3 >= argc) {
+                    throw std::invalid_argument(arg + " needs a base, a source and an output folder");
+                }
+                scene_merges.push_back({ argv[i + 1], argv[i + 2], argv[i + 3] });
+                i += 3;
+            }
+            else if (arg == "--merge-config") {
+                if (i + 1 == argc) {
+                    throw std::invalid_argument(arg + " needs a list of merge options");
+                }
+                merge_config = gbs::parse_config(argv[++i]);
+            }
+            else if (arg == "--compress") {
+                compress = true;
+            }
+            else if (arg == "--lzms") {
+                compress = true;
+                compression = gfs_compressed::codec::lzms;
+            }
+            else if (arg == "--verify") {
+                verify = true;
+            }
+            else if (arg == "--stats") {
+                print_stats = true;
+            }
+            else if (arg == "--trace") {
+                if (i + 1 == argc) {
+                    throw std::invalid_argument(arg + " needs an output path");
+                }
+                trace_path = argv[++i];
+            }
+            else {
+                paths.push_back(arg);
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        std::cout << e.what() << '\n';
+        return 1;
+    }
+    if (paths.empty() && diffs.empty() && applies.empty() && scene_merges.empty()) {
+        std::cout << "There are no files" << '\n';
+        return 0;
+    }
+    if (print_stats || !trace_path.empty()) {
+        trace::enable();
+    }
+    GFSUnpacker GFSUnpack(jobs, queue_depth);
+    GFSPacker GFSpack(metadata_reserve, alignment, jobs, incremental, compare_hashes, queue_depth);
+    file_io::set_io_limit(io_limit);
+    GFSPatch patcher(jobs);
+    auto print_summary = [](const GFSPatch::Summary& summary) {
+        std::cout << summary.added << " added, " << summary.changed << " changed, " << summary.removed << " removed, "
+            << summary.unchanged << " unchanged" << '\n';
+    };
+    for (const auto& diff : diffs) {
+        std::cout << "Diff:" << diff[0] << " -> " << diff[1] << '\n';
+        try {
+            print_summary(patcher.diff(diff[0], diff[1], diff[2]));
+        }
+        catch (const std::exception& e) {
+            std::cout << "Error: " << e.what() << '\n';
+        }
+    }
+    for (const auto& apply : applies) {
+        std::cout << "Apply:" << apply[1] << " to " << apply[0] << '\n';
+        try {
+            print_summary(patcher.apply(apply[0], apply[1], apply[2]));
+        }
+        catch (const std::exception& e) {
+            std::cout << "Error: " << e.what() << '\n';
+        }
+    }
+    for (const auto& scene_merge : scene_merges) {
+        std::cout << "Merge scenes:" << scene_merge[1] << " into " << scene_merge[0] << " -> " << scene_merge[2] << '\n';
+        try {
+            // Scene pairs are independent, so they are merged side by side on one pool
+            gbs::scene_pairs pairs = gbs::pair_scenes(scene_merge[0], scene_merge[1]);
+            std::vector<gbs::merge_summary> summaries(pairs.matched.size());
+            std::vector<batch::job> batch_jobs;
+            for (size_t s = 0; s < pairs.matched.size(); ++s) {
+                std::filesystem::path base_path = (scene_merge[0] / pairs.matched[s]).make_preferred();
+                std::filesystem::path source_path = (scene_merge[1] / pairs.matched[s]).make_preferred();
+                std::filesystem::path output_path = (scene_merge[2] / pairs.matched[s]).make_preferred();
+                std::error_code ec;
+                // Both scenes are held in memory, read and parsed, next to the merged one
+                uint64_t memory = (std::filesystem::file_size(base_path, ec) + std::filesystem::file_size(source_path, ec)) * 4;
+                batch_jobs.push_back({ pairs.matched[s], memory, [&summaries, &merge_config, s, base_path, source_path, output_path] {
+                    summaries[s] = gbs::merge_files(base_path, { source_path }, output_path, merge_config);
+                } });
+            }
+            auto results = batch::run(batch_jobs, batch_workers, memory_limit);
+            gbs::merge_summary total;
+            size_t failed = 0;
+            for (size_t s = 0; s < results.size(); ++s) {
+                if (!results[s].ok) {
+                    std::cout << "Error: " << pairs.matched[s] << ": " << results[s].message << '\n';
+                    ++failed;
+                    continue;
+                }
+                std::cout << pairs.matched[s] << ": +" << summaries[s].glyphs_added << " glyphs, +" << summaries[s].fonts_added << " fonts, +"
+                    << summaries[s].textures_added << " textures (" << results[s].seconds << " s)" << '\n';
+                total.glyphs_added += summaries[s].glyphs_added;
+                total.fonts_added += summaries[s].fonts_added;
+                total.textures_added += summaries[s].textures_added;
+            }
+            for (const auto& scene : pairs.base_only) {
+                std::cout << "Only in base: " << scene << '\n';
+            }
+            for (const auto& scene : pairs.source_only) {
+                std::cout << "Only in source: " << scene << '\n';
+            }
+            std::cout << results.size() - failed << " of " << results.size() << " scenes merged: +" << total.glyphs_added << " glyphs, +"
+                << total.fonts_added << " fonts, +" << total.textures_added << " textures" << '\n';
+        }
+        catch (const std::exception& e) {
+            std::cout << "Error: " << e.what() << '\n';
+        }
+    }
+    std::mutex output_mutex;
+    GFSVerifier verifier(jobs);
+    auto print_report = [&](const std::filesystem::path& fileread, const GFSVerifier::Report& report) {
+        std::lock_guard lock(output_mutex);
+        if (report.ok()) {
+            std::cout << "OK: " << fileread << " (" << report.checked << " files checked)" << '\n';
+            return;
+        }
+        std::cout << "Failed: " << fileread << " (" << report.problems.size() << " problems in " << report.checked << " files)" << '\n';
+        for (const auto& problem : report.problems) {
+            std::cout << "  " << problem << '\n';
+        }
+    };
+    auto process = [&](const std::filesystem::path& fileread) {
+        if (verify) {
+            if (fileread.extension() == "") {
+                // A folder is compared with the archive it was unpacked from
+                std::filesystem::path archive_path = fileread;
+                archive_path += ".gfs";
+                print_report(fileread, verifier.compare_directory(archive_path, fileread));
+            }
+            else if (std::filesystem::exists(GFSVerifier::sums_path(fileread))) {
+                print_report(fileread, verifier.check_sums(fileread));
+            }
+            else {
+                verifier.write_sums(fileread);
+                std::lock_guard lock(output_mutex);
+                std::cout << "Checksums written: " << GFSVerifier::sums_path(fileread) << '\n';
+            }
+        }
+        else if (fileread.extension() == "") {
             GFSpack(fileread);
         }
+        else if (fileread.extension() == ".gfsz") {
+            if (files_to_extract.empty()) {
+                gfs_compressed::decompress(fileread, jobs);
+                return;
+            }
+            // Only the frames holding the file table and the wanted files are decompressed
+            gfs_compressed::reader container(fileread);
+            std::filesystem::path output_dir = fileread;
+            output_dir.replace_extension("");
+            for (const auto& relative_path : files_to_extract) {
+                const GFSView::Entry* entry = container.find(relative_path);
+                if (entry == nullptr) {
+                    std::lock_guard lock(output_mutex);
+                    std::cout << "Error: File not found in archive: " << relative_path << '\n';
+                    continue;
+                }
+                std::filesystem::path output_path = output_dir / relative_path;
+                container.extract(*entry, output_path.make_preferred());
+            }
+        }
+        else if (compress) {
+            gfs_compressed::compress(fileread, jobs, compression);
+        }
+        else if (!files_to_extract.empty()) {
+            // Single lookups go through the sidecar index instead of the file table
+            GFSIndex index(fileread);
+            std::filesystem::path output_dir = fileread;
+            output_dir.replace_extension("");
+            for (const auto& relative_path : files_to_extract) {
+                const GFSIndex::Entry* entry = index.find(relative_path);
+                if (entry == nullptr) {
+                    std::lock_guard lock(output_mutex);
+                    std::cout << "Error: File not found in archive: " << relative_path << '\n';
+                    continue;
+                }
+                std::filesystem::path output_path = output_dir / relative_path;
+                index.extract(*entry, output_path.make_preferred());
+            }
+        }
+        else if (realign != 0) {
+            GFSEdit archive(fileread);
+            archive.set_alignment(realign, true);
+            archive.commit_changes();
+        }
         else {
             GFSUnpack(fileread);
         }
-    } //for
+    };
+
+    if (paths.size() <= 1 || batch_workers == 1) {
+        for (const auto& fileread : paths) {
+            std::cout << "File Read Path:" << fileread << '\n';
+            try {
+                process(fileread);
+            }
+            catch (const std::exception& e) {
+                std::cout << "Error: " << e.what() << '\n';
+            }
+        } //for
+    }
+    else {
+        // Archives are independent, so they run side by side on one pool
+        std::vector<batch::job> batch_jobs;
+        for (const auto& fileread : paths) {
+            uint64_t memory = fileread.extension() == "" ? GFSpack.memory_estimate() : GFSUnpacker::memory_estimate(fileread);
+            batch_jobs.push_back({ fileread, memory, [&process, fileread] { process(fileread); } });
+        }
+        auto results = batch::run(batch_jobs, batch_workers, memory_limit, [&](const batch::result& result) {
+            std::lock_guard lock(output_mutex);
+            if (result.ok) {
+                std::cout << "Done: " << result.path << " (" << result.seconds << " s)" << '\n';
+            }
+            else {
+                std::cout << "Error: " << result.path << ": " << result.message << '\n';
+            }
+        });
+        size_t failed = std::count_if(results.begin(), results.end(), [](const batch::result& result) { return !result.ok; });
+        std::cout << results.size() - failed << " of " << results.size() << " archives done";
+        if (failed > 0) {
+            std::cout << ", " << failed << " failed:" << '\n';
+            for (const auto& result : results) {
+                if (!result.ok) std::cout << "  " << result.path << ": " << result.message << '\n';
+            }
+        }
+        else {
+            std::cout << '\n';
+        }
+    }
+    if (print_stats) {
+        trace::print_stats(std::cout);
+    }
+    if (!trace_path.empty()) {
+        try {
+            trace::write_chrome_json(trace_path);
+        }
+        catch (const std::exception& e) {
+            std::cout << "Error: " << e.what() << '\n';
+        }
+    }
 } //main
 
 int test() {
@@ -0,0 +1,78 @@
+#include "batch.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace batch {
+    std::vector<result> run(const std::vector<job>& jobs, unsigned workers, uint64_t memory_budget,
+        const std::function<void(const result&)>& done) {
+        std::vector<result> results(jobs.size());
+        if (workers == 0) {
+            workers = std::max(1u, std::thread::hardware_concurrency());
+        }
+        workers = (unsigned)std::min<size_t>(workers, std::max<size_t>(jobs.size(), 1));
+
+        std::mutex mutex;
+        std::condition_variable memory_freed;
+        uint64_t memory_in_use = 0;
+        size_t running = 0;
+        size_t next_job = 0; // handed out in order
+
+        auto worker = [&] {
+            for (;;) {
+                size_t j;
+                uint64_t memory;
+                {
+                    std::unique_lock lock(mutex);
+                    if (next_job == jobs.size()) return;
+                    j = next_job++;
+                    memory = memory_budget == 0 ? 0 : std::min(jobs[j].memory, memory_budget);
+                    memory_freed.wait(lock, [&] { return running == 0 || memory_in_use + memory <= memory_budget; });
+                    memory_in_use += memory;
+                    ++running;
+                }
+
+                result& r = results[j];
+                r.path = jobs[j].path;
+                r.ok = true;
+                auto start = std::chrono::steady_clock::now();
+                try {
+                    trace::scope phase("batch.job");
+                    jobs[j].run();
+                }
+                catch (const std::exception& e) {
+                    r.ok = false;
+                    r.message = e.what();
+                }
+                catch (...) {
+                    r.ok = false;
+                    r.message = "Unknown error";
+                }
+                r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                {
+                    std::lock_guard lock(mutex);
+                    memory_in_use -= memory;
+                    --running;
+                    if (done) done(r);
+                }
+                memory_freed.notify_all();
+            }
+        };
+
+        std::vector<std::thread> pool;
+        pool.reserve(workers);
+        for (unsigned w = 0; w < workers; ++w) {
+            pool.emplace_back(worker);
+        }
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        return results;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace fs = std::filesystem;
+
+// Runs independent archive jobs side by side on one worker pool
+namespace batch {
+    struct job {
+        fs::path path;
+        // Peak memory the job is expected to need, checked against the budget
+        uint64_t memory;
+        std::function<void()> run;
+    };
+    struct result {
+        fs::path path;
+        bool ok;
+        std::string message;
+        double seconds;
+    };
+
+    // Runs every job on `workers` threads (0 picks the hardware concurrency),
+    // which pick them up in order. A job only starts while the memory of the jobs
+    // already running plus its own stays within `memory_budget` (0 means no
+    // budget); a job bigger than the whole budget runs alone. A job that
+    // throws is reported and the others go on. `done` is called once per job
+    // as it finishes, never from two threads at once. Results are returned in
+    // job order.
+    std::vector<result> run(const std::vector<job>& jobs, unsigned workers, uint64_t memory_budget,
+        const std::function<void(const result&)>& done = {});
+}
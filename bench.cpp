@@ -0,0 +1,466 @@
+// Benchmarks for the GFS code paths on synthetic archives.
+//
+// Every shape is generated into a fresh temp directory, then packed,
+// unpacked, opened, extracted, looked up in and edited. Results go out as
+// JSON (one object per shape), timings are wall clock with a warm cache.
+//
+// SkullModBench [--shape tiny|blobs|mixed|all] [--scale N] [--jobs N]
+//               [--blob-mb N] [--out results.json] [--keep]
+// SkullModBench --self-check runs the correctness checks instead (crc32c_combine
+// over 513 MB, a v1 -> v2 -> v3 patch chain), untimed.
+#define _CRT_SECURE_NO_WARNINGS
+#include <windows.h>
+#include <psapi.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "gfs.h"
+#include "gfs_index.h"
+#include "gfs_overlay.h"
+#include "file_io.h"
+#include "checksum.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+    struct Options {
+        std::string shape = "all";
+        unsigned scale = 1;
+        unsigned jobs = 0;
+        uint64_t blob_mb = 2048;
+        fs::path out;
+        bool keep = false;
+        bool self_check = false;
+    };
+
+    struct Shape {
+        std::string name;
+        std::vector<std::pair<std::string, uint64_t>> files; // relative path, size
+    };
+
+    struct Result {
+        std::string op;
+        double seconds;
+        uint64_t bytes;
+        uint64_t entries;
+        uint64_t rss;
+        uint64_t peak_rss;
+    };
+
+    // Deterministic content, cheap enough not to dominate generation
+    struct Random {
+        uint64_t state;
+        uint64_t next() {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state;
+        }
+        uint64_t between(uint64_t low, uint64_t high) { return low + next() % (high - low + 1); }
+    };
+
+    std::string file_name(size_t i) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "dir%03zu/sub%02zu/file%06zu.bin", i % 97, i % 13, i);
+        return name;
+    }
+
+    Shape make_shape(const std::string& name, const Options& options) {
+        Shape shape{ name, {} };
+        Random random{ 0x5EED5EED5EEDull };
+        if (name == "tiny") {
+            size_t count = 100000 / options.scale;
+            for (size_t i = 0; i < count; ++i) {
+                shape.files.push_back({ file_name(i), random.between(16, 512) });
+            }
+        }
+        else if (name == "blobs") {
+            uint64_t blob_size = options.blob_mb * 1024 * 1024 / options.scale;
+            for (size_t i = 0; i < 3; ++i) {
+                shape.files.push_back({ "blobs/blob" + std::to_string(i) + ".bin", blob_size + i * 4097 });
+            }
+        }
+        else if (name == "mixed") {
+            // Roughly what the game's data folders look like: mostly scripts
+            // and small scenes, some textures, a few large sound banks
+            size_t count = 20000 / options.scale;
+            for (size_t i = 0; i < count; ++i) {
+                uint64_t pick = random.next() % 100;
+                uint64_t size = pick < 70 ? random.between(0, 4096)
+                    : pick < 97 ? random.between(4096, 1024 * 1024)
+                    : random.between(1024 * 1024, 32 * 1024 * 1024);
+                shape.files.push_back({ file_name(i), size });
+            }
+        }
+        else {
+            throw std::invalid_argument("Unknown shape: " + name);
+        }
+        return shape;
+    }
+
+    void generate(const Shape& shape, const fs::path& root) {
+        std::vector<unsigned char> pattern(file_io::COPY_CHUNK_SIZE);
+        Random random{ 0xC0FFEEull };
+        for (size_t i = 0; i < pattern.size(); i += 8) {
+            uint64_t value = random.next();
+            std::memcpy(pattern.data() + i, &value, 8);
+        }
+        for (size_t i = 0; i < shape.files.size(); ++i) {
+            fs::path path = root / shape.files[i].first;
+            fs::create_directories(path.parent_path());
+            HANDLE file = CreateFile(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE) {
+                throw std::runtime_error("Failed to create file: " + path.string());
+            }
+            // Every file starts at a different spot of the pattern
+            uint64_t remaining = shape.files[i].second;
+            size_t start = (i * 4099) % pattern.size();
+            while (remaining > 0) {
+                size_t length = (size_t)std::min<uint64_t>(remaining, pattern.size() - start);
+                file_io::write_all(file, { pattern.data() + start, length });
+                remaining -= length;
+                start = 0;
+            }
+            CloseHandle(file);
+        }
+    }
+
+    void memory_usage(uint64_t& rss, uint64_t& peak_rss) {
+        PROCESS_MEMORY_COUNTERS counters{};
+        counters.cb = sizeof(counters);
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+            rss = counters.WorkingSetSize;
+            peak_rss = counters.PeakWorkingSetSize;
+        }
+    }
+
+    template<typename F>
+    Result measure(const std::string& op, uint64_t bytes, uint64_t entries, F&& run) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto stop = std::chrono::steady_clock::now();
+        Result result{ op, std::chrono::duration<double>(stop - start).count(), bytes, entries, 0, 0 };
+        memory_usage(result.rss, result.peak_rss);
+        std::cerr << "  " << op << ": " << result.seconds << " s";
+        if (result.seconds > 0) {
+            std::cerr << ", " << bytes / result.seconds / (1024 * 1024) << " MB/s, " << entries / result.seconds << " entries/s";
+        }
+        std::cerr << '\n';
+        return result;
+    }
+
+    // crc32c_combine against a checksum run straight over the same bytes.
+    // B is longer than 2^29 bytes, so the combine needs x^(2^n) past n = 31.
+    void check_crc32c_combine() {
+        std::vector<unsigned char> chunk(1024 * 1024);
+        Random random{ 7 };
+        for (auto& byte : chunk) {
+            byte = (unsigned char)random.next();
+        }
+        const uint64_t chunks = 513;
+        uint32_t a = checksum::crc32c(std::span<const unsigned char>(chunk).first(1000));
+        uint32_t b = 0;
+        uint32_t direct = a;
+        for (uint64_t i = 0; i < chunks; ++i) {
+            b = checksum::crc32c(chunk, b);
+            direct = checksum::crc32c(chunk, direct);
+        }
+        if (checksum::crc32c_combine(a, b, chunks * chunk.size()) != direct) {
+            throw std::runtime_error("crc32c_combine disagrees with crc32c over " + std::to_string(chunks) + " MB");
+        }
+    }
+
+    // Three versions of an archive, each packed with another layout: applying
+    // the v1 -> v2 patch to v1 and then the v2 -> v3 patch to the result has to
+    // rebuild v2 and v3 byte for byte, or the second patch would not fit
+    void check_patch_chain(const fs::path& temp) {
+        fs::path root = temp / "patch_chain";
+        Random random{ 11 };
+        auto content = [&](size_t size) {
+            std::vector<unsigned char> data(size);
+            for (auto& byte : data) {
+                byte = (unsigned char)random.next();
+            }
+            return data;
+        };
+        std::vector<std::pair<std::string, std::vector<unsigned char>>> files;
+        for (size_t i = 0; i < 50; ++i) {
+            files.push_back({ file_name(i), content(random.between(0, 5000)) });
+        }
+        auto read_archive = [](const fs::path& path) {
+            std::ifstream file(path, std::ios::binary);
+            return std::vector<unsigned char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        };
+
+        std::vector<fs::path> archives;
+        const uint32_t alignments[] = { 1, 512, 16 };
+        for (size_t version = 0; version < 3; ++version) {
+            if (version > 0) {
+                // One change in place, one resize, one removal and two new files
+                files[version].second[0] ^= 0xFF;
+                files[version + 10].second = content(random.between(1, 5000));
+                files.erase(files.begin() + version + 20);
+                files.push_back({ "added/v" + std::to_string(version) + "a.bin", content(1000) });
+                files.insert(files.begin(), { "added/v" + std::to_string(version) + "b.bin", content(0) });
+            }
+            fs::path source = root / ("v" + std::to_string(version + 1));
+            for (const auto& [path, data] : files) {
+                fs::create_directories((source / path).parent_path());
+                file_io::write_file(source / path, data);
+            }
+            GFSPacker(0, alignments[version], 1)(source);
+            archives.push_back(source.string() + ".gfs");
+        }
+
+        fs::path applied = root / "applied.gfs";
+        fs::copy_file(archives[0], applied);
+        GFSPatch patcher;
+        for (size_t version = 1; version < 3; ++version) {
+            fs::path patch = root / ("v" + std::to_string(version) + "-v" + std::to_string(version + 1) + ".gfs");
+            patcher.diff(archives[version - 1], archives[version], patch);
+            patcher.apply(applied, patch, applied);
+            if (read_archive(applied) != read_archive(archives[version])) {
+                throw std::runtime_error("Applied patches do not rebuild v" + std::to_string(version + 1));
+            }
+        }
+    }
+
+    std::string json_escape(const std::string& text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\') escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    std::string run_shape(const std::string& name, const Options& options, const fs::path& temp) {
+        Shape shape = make_shape(name, options);
+        uint64_t total_bytes = 0;
+        for (const auto& file : shape.files) {
+            total_bytes += file.second;
+        }
+        uint64_t count = shape.files.size();
+        std::cerr << name << ": " << count << " files, " << total_bytes / (1024 * 1024) << " MB\n";
+
+        fs::path root = temp / name;
+        fs::path source = root / "source";
+        fs::path archive = root / "source.gfs";
+        std::vector<Result> results;
+
+        results.push_back(measure("generate", total_bytes, count, [&] { generate(shape, source); }));
+        results.push_back(measure("pack", total_bytes, count, [&] { GFSPacker(0, 1, options.jobs)(source); }));
+        uint64_t archive_size = fs::file_size(archive);
+
+        // Unpack into a separate folder, the packer's input stays untouched
+        fs::path unpack_archive = root / "unpacked.gfs";
+        fs::copy_file(archive, unpack_archive);
+        results.push_back(measure("unpack", total_bytes, count, [&] { GFSUnpacker(options.jobs)(unpack_archive); }));
+        fs::remove_all(root / "unpacked");
+        fs::remove(unpack_archive);
+
+        const unsigned repeats = 10;
+        results.push_back(measure("view_open", 0, count * repeats, [&] {
+            for (unsigned r = 0; r < repeats; ++r) {
+                GFSView view(archive);
+            }
+        }));
+        results.push_back(measure("edit_open", 0, count * repeats, [&] {
+            for (unsigned r = 0; r < repeats; ++r) {
+                GFSEdit edit(archive);
+            }
+        }));
+
+        // Lookups: cold index build, warm index opens, then single finds
+        results.push_back(measure("index_build", 0, count, [&] { GFSIndex index(archive); }));
+        results.push_back(measure("index_open", 0, repeats, [&] {
+            for (unsigned r = 0; r < repeats; ++r) {
+                GFSIndex index(archive);
+            }
+        }));
+        const size_t lookups = 100000;
+        std::vector<std::string> keys;
+        Random random{ 42 };
+        for (size_t i = 0; i < 1000; ++i) {
+            keys.push_back(shape.files[random.next() % count].first);
+        }
+        {
+            GFSIndex index(archive);
+            results.push_back(measure("index_find", 0, lookups, [&] {
+                size_t found = 0;
+                for (size_t i = 0; i < lookups; ++i) {
+                    found += index.find(keys[i % keys.size()]) != nullptr;
+                }
+                if (found != lookups) {
+                    throw std::runtime_error("Index lookup missed");
+                }
+            }));
+        }
+
+        // Overlay: the archive mounted twice, so every path is shadowed once
+        results.push_back(measure("overlay_open", 0, count * 2, [&] { GFSOverlay overlay({ archive, archive }); }));
+        {
+            GFSOverlay overlay({ archive, archive });
+            results.push_back(measure("overlay_find", 0, lookups, [&] {
+                size_t found = 0;
+                for (size_t i = 0; i < lookups; ++i) {
+                    const GFSOverlay::Entry* entry = overlay.find(keys[i % keys.size()]);
+                    found += entry != nullptr && entry->layer == 1;
+                }
+                if (found != lookups) {
+                    throw std::runtime_error("Overlay lookup missed");
+                }
+            }));
+            std::vector<std::string> missing;
+            for (const auto& key : keys) {
+                missing.push_back(key + ".missing");
+            }
+            results.push_back(measure("overlay_miss", 0, lookups, [&] {
+                for (size_t i = 0; i < lookups; ++i) {
+                    if (overlay.find(missing[i % missing.size()]) != nullptr) {
+                        throw std::runtime_error("Overlay found a missing path");
+                    }
+                }
+            }));
+        }
+
+        {
+            GFSEdit edit(archive);
+            fs::path out = root / "extract";
+            // Up to 100 distinct files and at most one pass over the shape's
+            // data, so the blobs shape extracts each blob once
+            std::unordered_map<std::string_view, uint64_t> sizes;
+            for (const auto& file : shape.files) {
+                sizes.emplace(file.first, file.second);
+            }
+            std::vector<std::string_view> picked;
+            std::unordered_set<std::string_view> seen;
+            uint64_t picked_bytes = 0;
+            for (const auto& key : keys) {
+                if (picked.size() == 100) break;
+                if (!seen.insert(key).second) continue;
+                if (picked_bytes + sizes[key] > total_bytes) break;
+                picked.push_back(key);
+                picked_bytes += sizes[key];
+            }
+            results.push_back(measure("extract_file", picked_bytes, picked.size(), [&] {
+                for (const auto& key : picked) {
+                    edit.extract_file(std::string(key), out / "single" / key);
+                }
+            }));
+            results.push_back(measure("extract_files", total_bytes, count, [&] { edit.extract_files(out / "all", "", options.jobs); }));
+            fs::remove_all(out);
+
+            // Replacing a file with one of another size forces a full rewrite,
+            // the reserve it leaves behind lets the next addition go in place
+            fs::path replacement = root / "replacement.bin";
+            file_io::write_file(replacement, std::vector<unsigned char>(1234, 0xAB));
+            fs::path addition = root / "addition.bin";
+            file_io::write_file(addition, std::vector<unsigned char>(4321, 0xCD));
+            edit.set_metadata_reserve(64 * 1024);
+            edit.add_file(replacement, shape.files[0].first, true);
+            results.push_back(measure("commit_rewrite", archive_size, count, [&] { edit.commit_changes(); }));
+            edit.add_file(addition, "bench/addition.bin");
+            results.push_back(measure("commit_in_place", 4321, 1, [&] { edit.commit_changes(); }));
+        }
+
+        std::ostringstream json;
+        json << "{\"shape\":\"" << json_escape(name) << "\",\"files\":" << count << ",\"bytes\":" << total_bytes
+            << ",\"archive_bytes\":" << archive_size << ",\"jobs\":" << options.jobs << ",\"results\":[";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& result = results[i];
+            double mb_per_s = result.seconds > 0 ? result.bytes / result.seconds / (1024 * 1024) : 0;
+            double entries_per_s = result.seconds > 0 ? result.entries / result.seconds : 0;
+            json << (i ? "," : "") << "{\"op\":\"" << result.op << "\",\"seconds\":" << result.seconds
+                << ",\"bytes\":" << result.bytes << ",\"entries\":" << result.entries
+                << ",\"mb_per_s\":" << mb_per_s << ",\"entries_per_s\":" << entries_per_s
+                << ",\"rss_bytes\":" << result.rss << ",\"peak_rss_bytes\":" << result.peak_rss << "}";
+        }
+        json << "]}";
+
+        if (!options.keep) {
+            fs::remove_all(root);
+        }
+        return json.str();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 == argc) {
+                    throw std::invalid_argument(arg + " needs a value");
+                }
+                return argv[++i];
+            };
+            if (arg == "--shape") options.shape = value();
+            else if (arg == "--scale") options.scale = std::max(1ul, std::stoul(value()));
+            else if (arg == "--jobs") options.jobs = (unsigned)std::stoul(value());
+            else if (arg == "--blob-mb") options.blob_mb = std::stoull(value());
+            else if (arg == "--out") options.out = value();
+            else if (arg == "--keep") options.keep = true;
+            else if (arg == "--self-check") options.self_check = true;
+            else throw std::invalid_argument("Unknown argument: " + arg);
+        }
+        if (options.jobs == 0) {
+            options.jobs = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        std::vector<std::string> shapes;
+        if (options.shape == "all") {
+            shapes = { "tiny", "blobs", "mixed" };
+        }
+        else {
+            shapes = { options.shape };
+        }
+
+        fs::path temp = fs::temp_directory_path() / ("skullmod-bench-" + std::to_string(GetCurrentProcessId()));
+        fs::create_directories(temp);
+        std::string json = "[";
+        try {
+            if (options.self_check) {
+                check_crc32c_combine();
+                check_patch_chain(temp);
+            }
+            for (size_t i = 0; i < shapes.size() && !options.self_check; ++i) {
+                json += (i ? ",\n" : "\n") + run_shape(shapes[i], options, temp);
+            }
+        }
+        catch (...) {
+            if (!options.keep) fs::remove_all(temp);
+            throw;
+        }
+        json += "\n]\n";
+        if (!options.keep) {
+            fs::remove_all(temp);
+        }
+        if (options.self_check) {
+            std::cerr << "Self-check passed\n";
+            return 0;
+        }
+
+        if (options.out.empty()) {
+            std::cout << json;
+        }
+        else {
+            std::ofstream(options.out, std::ios::binary) << json;
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <emmintrin.h>
+#define BYTE_ORDER_SSE2
+#endif
+
+// Integers stored in a fixed byte order at any (unaligned) address. GFS is
+// big-endian, GBS little-endian. Loads and stores come down to one move and
+// at most one bswap; the *_array versions swap whole runs of 32-bit fields
+// 16 bytes at a time. Pointer versions trust the caller, span versions check
+// the bounds and throw std::out_of_range.
+namespace byte_order {
+    template<typename T>
+    constexpr T byteswap(T value) noexcept {
+        static_assert(std::is_integral_v<T>, "byteswap requires an integral type.");
+        if constexpr (sizeof(T) == 1) {
+            return value;
+        }
+        else {
+            if (!std::is_constant_evaluated()) {
+                if constexpr (sizeof(T) == 2) {
+                    return static_cast<T>(_byteswap_ushort(static_cast<unsigned short>(value)));
+                }
+                else if constexpr (sizeof(T) == 4) {
+                    return static_cast<T>(_byteswap_ulong(static_cast<unsigned long>(value)));
+                }
+                else if constexpr (sizeof(T) == 8) {
+                    return static_cast<T>(_byteswap_uint64(static_cast<unsigned __int64>(value)));
+                }
+            }
+            std::make_unsigned_t<T> in = static_cast<std::make_unsigned_t<T>>(value);
+            std::make_unsigned_t<T> out = 0;
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                out = static_cast<std::make_unsigned_t<T>>((out << 8) | (in & 0xFF));
+                in = static_cast<std::make_unsigned_t<T>>(in >> 8);
+            }
+            return static_cast<T>(out);
+        }
+    }
+
+    template<typename T>
+    constexpr T load_le(const unsigned char* bytes) noexcept {
+        static_assert(std::is_integral_v<T>, "load_le requires an integral type.");
+        if (std::is_constant_evaluated()) {
+            std::make_unsigned_t<T> value = 0;
+            for (size_t i = sizeof(T); i-- > 0;) {
+                value = static_cast<std::make_unsigned_t<T>>((value << 8) | bytes[i]);
+            }
+            return static_cast<T>(value);
+        }
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return std::endian::native == std::endian::little ? value : byteswap(value);
+    }
+
+    template<typename T>
+    constexpr T load_be(const unsigned char* bytes) noexcept {
+        return byteswap(load_le<T>(bytes));
+    }
+
+    template<typename T>
+    constexpr void store_le(unsigned char* bytes, T value) noexcept {
+        static_assert(std::is_integral_v<T>, "store_le requires an integral type.");
+        if (std::is_constant_evaluated()) {
+            std::make_unsigned_t<T> in = static_cast<std::make_unsigned_t<T>>(value);
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                bytes[i] = static_cast<unsigned char>(in & 0xFF);
+                in = static_cast<std::make_unsigned_t<T>>(in >> 8);
+            }
+            return;
+        }
+        if constexpr (std::endian::native != std::endian::little) {
+            value = byteswap(value);
+        }
+        std::memcpy(bytes, &value, sizeof(T));
+    }
+
+    template<typename T>
+    constexpr void store_be(unsigned char* bytes, T value) noexcept {
+        store_le(bytes, byteswap(value));
+    }
+
+    namespace detail {
+        inline void check_range(size_t size, size_t offset, size_t length) {
+            if (offset > size || length > size - offset) {
+                throw std::out_of_range("Buffer read out of range");
+            }
+        }
+    }
+
+    template<typename T>
+    T load_le(std::span<const unsigned char> bytes, size_t offset) {
+        detail::check_range(bytes.size(), offset, sizeof(T));
+        return load_le<T>(bytes.data() + offset);
+    }
+
+    template<typename T>
+    T load_be(std::span<const unsigned char> bytes, size_t offset) {
+        detail::check_range(bytes.size(), offset, sizeof(T));
+        return load_be<T>(bytes.data() + offset);
+    }
+
+    // Reverses the bytes of `count` 32-bit values from src to dst, which may
+    // be the same buffer. Neither needs to be aligned.
+    inline void byteswap_array32(const void* src, void* dst, size_t count) noexcept {
+        const unsigned char* in = static_cast<const unsigned char*>(src);
+        unsigned char* out = static_cast<unsigned char*>(dst);
+        size_t i = 0;
+#ifdef BYTE_ORDER_SSE2
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 4));
+            // Swap the 16-bit halves of every lane, then the bytes of every half
+            v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 4), v);
+        }
+#endif
+        for (; i < count; ++i) {
+            uint32_t value;
+            std::memcpy(&value, in + i * 4, 4);
+            value = byteswap(value);
+            std::memcpy(out + i * 4, &value, 4);
+        }
+    }
+
+    // `count` 32-bit fields stored back to back
+    inline void load_le_array(const unsigned char* bytes, uint32_t* values, size_t count) noexcept {
+        if constexpr (std::endian::native == std::endian::little) {
+            std::memcpy(values, bytes, count * 4);
+        }
+        else {
+            byteswap_array32(bytes, values, count);
+        }
+    }
+
+    inline void load_be_array(const unsigned char* bytes, uint32_t* values, size_t count) noexcept {
+        if constexpr (std::endian::native == std::endian::big) {
+            std::memcpy(values, bytes, count * 4);
+        }
+        else {
+            byteswap_array32(bytes, values, count);
+        }
+    }
+
+    inline void store_le_array(unsigned char* bytes, const uint32_t* values, size_t count) noexcept {
+        if constexpr (std::endian::native == std::endian::little) {
+            std::memcpy(bytes, values, count * 4);
+        }
+        else {
+            byteswap_array32(values, bytes, count);
+        }
+    }
+
+    inline void store_be_array(unsigned char* bytes, const uint32_t* values, size_t count) noexcept {
+        if constexpr (std::endian::native == std::endian::big) {
+            std::memcpy(bytes, values, count * 4);
+        }
+        else {
+            byteswap_array32(values, bytes, count);
+        }
+    }
+
+    inline void load_le_array(std::span<const unsigned char> bytes, size_t offset, std::span<uint32_t> values) {
+        detail::check_range(bytes.size(), offset, values.size() * 4);
+        load_le_array(bytes.data() + offset, values.data(), values.size());
+    }
+
+    inline void load_be_array(std::span<const unsigned char> bytes, size_t offset, std::span<uint32_t> values) {
+        detail::check_range(bytes.size(), offset, values.size() * 4);
+        load_be_array(bytes.data() + offset, values.data(), values.size());
+    }
+}
@@ -0,0 +1,170 @@
+#include "checksum.h"
+#include "file_io.h"
+#include <array>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CHECKSUM_SSE42
+#endif
+
+namespace checksum {
+    namespace {
+        // Slicing-by-8 tables for the reflected Castagnoli polynomial
+        constexpr uint32_t POLYNOMIAL = 0x82F63B78;
+
+        constexpr std::array<std::array<uint32_t, 256>, 8> make_tables() {
+            std::array<std::array<uint32_t, 256>, 8> tables{};
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit) {
+                    crc = (crc >> 1) ^ (POLYNOMIAL & (0u - (crc & 1)));
+                }
+                tables[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; ++i) {
+                for (size_t t = 1; t < 8; ++t) {
+                    tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
+                }
+            }
+            return tables;
+        }
+        constexpr auto TABLES = make_tables();
+
+        // Works on the inverted register, like the instruction does
+        uint32_t crc32c_software(uint32_t crc, const unsigned char* ptr, size_t length) {
+            while (length >= 8) {
+                uint32_t low;
+                uint32_t high;
+                std::memcpy(&low, ptr, 4);
+                std::memcpy(&high, ptr + 4, 4);
+                low ^= crc;
+                crc = TABLES[7][low & 0xFF] ^ TABLES[6][(low >> 8) & 0xFF] ^
+                    TABLES[5][(low >> 16) & 0xFF] ^ TABLES[4][low >> 24] ^
+                    TABLES[3][high & 0xFF] ^ TABLES[2][(high >> 8) & 0xFF] ^
+                    TABLES[1][(high >> 16) & 0xFF] ^ TABLES[0][high >> 24];
+                ptr += 8;
+                length -= 8;
+            }
+            while (length--) {
+                crc = (crc >> 8) ^ TABLES[0][(crc ^ *ptr++) & 0xFF];
+            }
+            return crc;
+        }
+
+#ifdef CHECKSUM_SSE42
+        // The SSE4.2 crc32 instruction computes CRC-32C directly
+        uint32_t crc32c_sse42(uint32_t crc, const unsigned char* ptr, size_t length) {
+#ifdef _M_X64
+            uint64_t crc64 = crc;
+            while (length >= 8) {
+                uint64_t value;
+                std::memcpy(&value, ptr, 8);
+                crc64 = _mm_crc32_u64(crc64, value);
+                ptr += 8;
+                length -= 8;
+            }
+            crc = (uint32_t)crc64;
+#else
+            while (length >= 4) {
+                uint32_t value;
+                std::memcpy(&value, ptr, 4);
+                crc = _mm_crc32_u32(crc, value);
+                ptr += 4;
+                length -= 4;
+            }
+#endif
+            while (length--) {
+                crc = _mm_crc32_u8(crc, *ptr++);
+            }
+            return crc;
+        }
+
+        bool cpu_has_sse42() {
+            int info[4];
+            __cpuid(info, 1);
+            return (info[2] & (1 << 20)) != 0;
+        }
+        const bool HAS_SSE42 = cpu_has_sse42();
+#endif
+
+        // Multiplication modulo the polynomial, bit reflected (as in zlib)
+        constexpr uint32_t multiply_mod(uint32_t a, uint32_t b) {
+            uint32_t product = 0;
+            for (uint32_t bit = 0x80000000u; bit != 0; bit >>= 1) {
+                if (a & bit) product ^= b;
+                b = (b & 1) ? (b >> 1) ^ POLYNOMIAL : b >> 1;
+            }
+            return product;
+        }
+        // x^(2^n) modulo the polynomial, for n = 0..30. x^(2^31) is x again,
+        // so the powers repeat with period 31 and x^(2^n) is POWERS[n % 31]
+        constexpr std::array<uint32_t, 31> make_powers() {
+            std::array<uint32_t, 31> powers{};
+            powers[0] = 0x40000000u; // x^1
+            for (size_t n = 1; n < 31; ++n) {
+                powers[n] = multiply_mod(powers[n - 1], powers[n - 1]);
+            }
+            return powers;
+        }
+        constexpr auto POWERS = make_powers();
+        static_assert(multiply_mod(POWERS[30], POWERS[30]) == POWERS[0], "x^(2^31) must reduce to x");
+    }
+
+    uint32_t crc32c(std::span<const unsigned char> data, uint32_t crc) {
+#ifdef CHECKSUM_SSE42
+        if (HAS_SSE42) {
+            return ~crc32c_sse42(~crc, data.data(), data.size());
+        }
+#endif
+        return ~crc32c_software(~crc, data.data(), data.size());
+    }
+
+    bool crc32c_hardware() {
+#ifdef CHECKSUM_SSE42
+        return HAS_SSE42;
+#else
+        return false;
+#endif
+    }
+
+    uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t length2) {
+        // crc1 shifted over length2 zero bytes (x^(8 * length2)), then crc2 on top
+        uint32_t shift = 0x80000000u; // x^0
+        for (size_t n = 3; length2 != 0; length2 >>= 1, ++n) {
+            if (length2 & 1) shift = multiply_mod(POWERS[n % 31], shift);
+        }
+        return multiply_mod(shift, crc1) ^ crc2;
+    }
+
+    uint32_t crc32c_file(const fs::path& path) {
+        HANDLE file = CreateFile(
+            path.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+            NULL
+        );
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Failed to open file: " + path.string());
+        }
+        thread_local std::vector<unsigned char> buffer;
+        buffer.resize(file_io::COPY_CHUNK_SIZE);
+        uint32_t crc = 0;
+        for (;;) {
+            DWORD read = 0;
+            if (!ReadFile(file, buffer.data(), (DWORD)buffer.size(), &read, NULL)) {
+                CloseHandle(file);
+                throw std::runtime_error("Failed to read file: " + path.string());
+            }
+            if (read == 0) break;
+            crc = crc32c({ buffer.data(), read }, crc);
+        }
+        CloseHandle(file);
+        return crc;
+    }
+}
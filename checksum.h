@@ -0,0 +1,21 @@
+#pragma once
+
+#include <filesystem>
+#include <span>
+#include <cstdint>
+
+namespace fs = std::filesystem;
+
+namespace checksum {
+    // CRC-32C (Castagnoli). Pass the previous result as `crc` to continue a
+    // running checksum over several pieces, start with 0.
+    // Uses the SSE4.2 crc32 instruction when the CPU has it.
+    uint32_t crc32c(std::span<const unsigned char> data, uint32_t crc = 0);
+    // True when crc32c runs on the SSE4.2 instruction
+    bool crc32c_hardware();
+    // CRC-32C of A followed by B from crc32c(A), crc32c(B) and B's length, so
+    // pieces of one buffer can be checksummed on different threads.
+    uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t length2);
+    // CRC-32C of a whole file, read in file_io::COPY_CHUNK_SIZE pieces.
+    uint32_t crc32c_file(const fs::path& path);
+}
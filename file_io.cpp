@@ -0,0 +1,844 @@
+#include "file_io.h"
+#include "trace.h"
+#include <winioctl.h>
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+#include <unordered_set>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+
+namespace file_io {
+    namespace {
+        std::atomic<unsigned> g_io_limit{ 0 };
+        std::mutex g_io_mutex;
+        std::condition_variable g_io_released;
+        unsigned g_io_busy = 0;
+
+        // Holds one of the set_io_limit slots for its lifetime
+        class io_slot {
+        public:
+            io_slot() {
+                if (t_held || g_io_limit.load(std::memory_order_relaxed) == 0) return;
+                std::unique_lock lock(g_io_mutex);
+                g_io_released.wait(lock, [] {
+                    unsigned limit = g_io_limit.load(std::memory_order_relaxed);
+                    return limit == 0 || g_io_busy < limit;
+                });
+                ++g_io_busy;
+                t_held = m_owner = true;
+            }
+            ~io_slot() {
+                if (!m_owner) return;
+                t_held = false;
+                {
+                    std::lock_guard lock(g_io_mutex);
+                    --g_io_busy;
+                }
+                g_io_released.notify_one();
+            }
+            io_slot(const io_slot&) = delete;
+            io_slot& operator=(const io_slot&) = delete;
+        private:
+            static thread_local bool t_held;
+            bool m_owner = false;
+        };
+        thread_local bool io_slot::t_held = false;
+    }
+
+    void set_io_limit(unsigned max_concurrent) {
+        {
+            std::lock_guard lock(g_io_mutex);
+            g_io_limit.store(max_concurrent, std::memory_order_relaxed);
+        }
+        g_io_released.notify_all();
+    }
+
+    mapped_file::mapped_file(const fs::path& path) {
+        trace::add(trace::counter::open_calls);
+        HANDLE file = CreateFile(
+            path.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL
+        );
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Failed to open file: " + path.string());
+        }
+        try {
+            _map(file);
+        }
+        catch (...) {
+            CloseHandle(file);
+            throw;
+        }
+        m_owns_file = true;
+    }
+
+    mapped_file::mapped_file(HANDLE file) {
+        _map(file);
+    }
+
+    mapped_file::~mapped_file() {
+        _release();
+    }
+
+    mapped_file::mapped_file(mapped_file&& other) noexcept
+        : m_file(std::exchange(other.m_file, INVALID_HANDLE_VALUE)),
+        m_owns_file(std::exchange(other.m_owns_file, false)),
+        m_mapping(std::exchange(other.m_mapping, HANDLE(NULL))),
+        m_data(std::exchange(other.m_data, nullptr)),
+        m_size(std::exchange(other.m_size, 0)) {
+    }
+
+    mapped_file& mapped_file::operator=(mapped_file&& other) noexcept {
+        if (this != &other) {
+            _release();
+            m_file = std::exchange(other.m_file, INVALID_HANDLE_VALUE);
+            m_owns_file = std::exchange(other.m_owns_file, false);
+            m_mapping = std::exchange(other.m_mapping, HANDLE(NULL));
+            m_data = std::exchange(other.m_data, nullptr);
+            m_size = std::exchange(other.m_size, 0);
+        }
+        return *this;
+    }
+
+    void mapped_file::_map(HANDLE file) {
+        LARGE_INTEGER liSize;
+        if (!GetFileSizeEx(file, &liSize)) {
+            throw std::runtime_error("Failed to get file size");
+        }
+        if ((uint64_t)liSize.QuadPart > SIZE_MAX) {
+            throw std::runtime_error("File is too big to map in this build");
+        }
+        // Empty files can not be mapped, they are represented by an empty view
+        if (liSize.QuadPart > 0) {
+            m_mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (m_mapping == NULL) {
+                throw std::runtime_error("Failed to create file mapping");
+            }
+            m_data = static_cast<const unsigned char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+            if (m_data == nullptr) {
+                CloseHandle(m_mapping);
+                m_mapping = NULL;
+                throw std::runtime_error("Failed to map view of file");
+            }
+        }
+        m_file = file;
+        m_size = (uint64_t)liSize.QuadPart;
+    }
+
+    void mapped_file::_release() noexcept {
+        if (m_data) {
+            UnmapViewOfFile(m_data);
+        }
+        if (m_mapping) {
+            CloseHandle(m_mapping);
+        }
+        if (m_owns_file && m_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_file);
+        }
+        m_file = INVALID_HANDLE_VALUE;
+        m_owns_file = false;
+        m_mapping = NULL;
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    std::span<const unsigned char> mapped_file::bytes(uint64_t offset, uint64_t length) const {
+        if (offset > m_size || length > m_size - offset) {
+            throw std::runtime_error("Read out of range of mapped file");
+        }
+        return { m_data + offset, (size_t)length };
+    }
+
+    void write_all(HANDLE file, std::span<const unsigned char> data) {
+        while (!data.empty()) {
+            DWORD chunk = (DWORD)std::min<uint64_t>(data.size(), COPY_CHUNK_SIZE);
+            DWORD written = 0;
+            io_slot slot;
+            if (!WriteFile(file, data.data(), chunk, &written, NULL) || written == 0) {
+                throw std::runtime_error("Failed to write file data");
+            }
+            trace::add(trace::counter::write_calls);
+            trace::add(trace::counter::bytes_written, written);
+            data = data.subspan(written);
+        }
+    }
+
+    void copy_range(HANDLE src, uint64_t src_offset, HANDLE dst, uint64_t length) {
+        if (length == 0) return;
+        // One buffer per thread, reused by every copy that thread makes
+        thread_local std::vector<unsigned char> buffer;
+        if (buffer.size() < COPY_CHUNK_SIZE) {
+            buffer.resize(COPY_CHUNK_SIZE);
+        }
+
+        LARGE_INTEGER liOffset;
+        liOffset.QuadPart = (LONGLONG)src_offset;
+        if (!SetFilePointerEx(src, liOffset, NULL, FILE_BEGIN)) {
+            throw std::runtime_error("Failed to set file pointer");
+        }
+        trace::add(trace::counter::seek_calls);
+        while (length > 0) {
+            DWORD chunk = (DWORD)std::min<uint64_t>(length, COPY_CHUNK_SIZE);
+            DWORD read = 0;
+            {
+                io_slot slot;
+                if (!ReadFile(src, buffer.data(), chunk, &read, NULL)) {
+                    throw std::runtime_error("Failed to read file data");
+                }
+            }
+            if (read == 0) {
+                throw std::runtime_error("Unexpected end of file");
+            }
+            trace::add(trace::counter::read_calls);
+            trace::add(trace::counter::bytes_read, read);
+            write_all(dst, { buffer.data(), read });
+            length -= read;
+        }
+    }
+
+    uint32_t block_clone_granularity(HANDLE file) {
+        DWORD flags = 0;
+        if (!GetVolumeInformationByHandleW(file, NULL, 0, NULL, NULL, &flags, NULL, 0) ||
+            !(flags & FILE_SUPPORTS_BLOCK_REFCOUNTING)) {
+            return 0;
+        }
+        FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity{};
+        DWORD returned = 0;
+        if (!DeviceIoControl(file, FSCTL_GET_INTEGRITY_INFORMATION, NULL, 0, &integrity, sizeof(integrity), &returned, NULL)) {
+            return 0;
+        }
+        return integrity.ClusterSizeInBytes;
+    }
+
+    void clone_range(HANDLE src, uint64_t src_offset, HANDLE dst, uint64_t dst_offset, uint64_t length, uint32_t cluster) {
+        trace::scope phase("clone_range");
+        LARGE_INTEGER liTarget;
+        liTarget.QuadPart = (LONGLONG)dst_offset;
+        if (!SetFilePointerEx(dst, liTarget, NULL, FILE_BEGIN)) {
+            throw std::runtime_error("Failed to set file pointer");
+        }
+
+        if (cluster == 0 || length < cluster || (src_offset - dst_offset) % cluster != 0) {
+            copy_range(src, src_offset, dst, length);
+            return;
+        }
+
+        // Unaligned head goes through the buffer
+        uint64_t head = (cluster - src_offset % cluster) % cluster;
+        copy_range(src, src_offset, dst, head);
+        src_offset += head;
+        dst_offset += head;
+        length -= head;
+
+        uint64_t aligned = length - length % cluster;
+        // The target has to cover the cloned region before the call
+        LARGE_INTEGER liEnd;
+        liEnd.QuadPart = (LONGLONG)(dst_offset + aligned);
+        LARGE_INTEGER liOldSize;
+        if (!GetFileSizeEx(dst, &liOldSize)) {
+            throw std::runtime_error("Failed to get file size");
+        }
+        if (liOldSize.QuadPart < liEnd.QuadPart) {
+            if (!SetFilePointerEx(dst, liEnd, NULL, FILE_BEGIN) || !SetEndOfFile(dst)) {
+                throw std::runtime_error("Failed to extend file");
+            }
+        }
+        // A single request has to stay below 4 GiB
+        const uint64_t max_clone = ((uint64_t(1) << 32) - 1) / cluster * cluster;
+        uint64_t cloned = 0;
+        while (cloned < aligned) {
+            DUPLICATE_EXTENTS_DATA extents{};
+            extents.FileHandle = src;
+            extents.SourceFileOffset.QuadPart = (LONGLONG)(src_offset + cloned);
+            extents.TargetFileOffset.QuadPart = (LONGLONG)(dst_offset + cloned);
+            extents.ByteCount.QuadPart = (LONGLONG)std::min(aligned - cloned, max_clone);
+            DWORD returned = 0;
+            if (!DeviceIoControl(dst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), NULL, 0, &returned, NULL)) {
+                break;
+            }
+            trace::add(trace::counter::clone_calls);
+            trace::add(trace::counter::bytes_cloned, extents.ByteCount.QuadPart);
+            cloned += extents.ByteCount.QuadPart;
+        }
+
+        // Tail, and whatever the file system refused to clone
+        liTarget.QuadPart = (LONGLONG)(dst_offset + cloned);
+        if (!SetFilePointerEx(dst, liTarget, NULL, FILE_BEGIN)) {
+            throw std::runtime_error("Failed to set file pointer");
+        }
+        copy_range(src, src_offset + cloned, dst, length - cloned);
+    }
+
+    void write_file(const fs::path& path, std::span<const unsigned char> data) {
+        write_file(path, { data });
+    }
+
+    void write_file(const fs::path& path, std::initializer_list<std::span<const unsigned char>> parts) {
+        trace::scope phase("write_file");
+        trace::add(trace::counter::open_calls);
+        HANDLE file = CreateFile(
+            path.c_str(),
+            GENERIC_WRITE,
+            0,
+            NULL,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL
+        );
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Failed to create output file: " + path.string());
+        }
+        try {
+            for (const auto& data : parts) {
+                write_all(file, data);
+            }
+        }
+        catch (...) {
+            CloseHandle(file);
+            throw;
+        }
+        CloseHandle(file);
+    }
+
+    namespace {
+        // NTFS names are case-insensitive, paths that differ only in case are
+        // the same file and must not be written from two threads
+        std::wstring path_key(const fs::path& path) {
+            std::wstring key = path.wstring();
+            CharUpperBuffW(key.data(), (DWORD)key.size());
+            return key;
+        }
+
+        // Keeps only the first task for every output path and creates the
+        // directories they need once. Returns the task indices in input order.
+        std::vector<size_t> prepare_write_tasks(const std::vector<write_task>& tasks) {
+            std::vector<size_t> order;
+            order.reserve(tasks.size());
+            {
+                std::vector<std::wstring> keys;
+                keys.reserve(tasks.size());
+                std::unordered_set<std::wstring_view> seen;
+                seen.reserve(tasks.size());
+                for (size_t i = 0; i < tasks.size(); ++i) {
+                    keys.push_back(path_key(tasks[i].output_path));
+                }
+                for (size_t i = 0; i < tasks.size(); ++i) {
+                    if (seen.insert(keys[i]).second) {
+                        order.push_back(i);
+                    }
+                }
+            }
+
+            std::set<fs::path> directories;
+            for (size_t idx : order) {
+                directories.insert(tasks[idx].output_path.parent_path());
+            }
+            for (const auto& directory : directories) {
+                if (directory.empty()) continue;
+                try {
+                    fs::create_directories(directory);
+                }
+                catch (const std::exception&) {
+                    // The tasks inside report the failure when they can't create their file
+                }
+            }
+            return order;
+        }
+
+        struct chunk_t {
+            size_t request;
+            uint64_t offset;
+            uint32_t length;
+        };
+        // Splits every request into COPY_CHUNK_SIZE pieces, an empty request
+        // into a single empty one
+        std::vector<chunk_t> split_requests(const std::vector<read_request>& requests) {
+            std::vector<chunk_t> chunks;
+            for (size_t r = 0; r < requests.size(); ++r) {
+                uint64_t done = 0;
+                do {
+                    uint32_t length = (uint32_t)std::min<uint64_t>(requests[r].length - done, COPY_CHUNK_SIZE);
+                    chunks.push_back({ r, done, length });
+                    done += length;
+                } while (done < requests[r].length);
+            }
+            return chunks;
+        }
+    }
+
+    std::vector<write_failure> write_files(const std::vector<write_task>& tasks, unsigned jobs) {
+        std::vector<write_failure> failures;
+        std::mutex failures_mutex;
+        auto run = [&](size_t idx) {
+            try {
+                write_file(tasks[idx].output_path, tasks[idx].data);
+            }
+            catch (const std::exception& e) {
+                std::lock_guard lock(failures_mutex);
+                failures.push_back({ idx, e.what() });
+            }
+        };
+
+        std::vector<size_t> order = prepare_write_tasks(tasks);
+
+        if (jobs == 0) {
+            jobs = std::max(1u, std::thread::hardware_concurrency());
+        }
+        jobs = (unsigned)std::min<size_t>(jobs, order.size());
+        if (jobs <= 1) {
+            for (size_t idx : order) {
+                run(idx);
+            }
+        }
+        else {
+            // Largest tasks first, each one goes to the least loaded thread
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return tasks[a].data.size() > tasks[b].data.size();
+            });
+            std::vector<std::vector<size_t>> buckets(jobs);
+            std::vector<uint64_t> load(jobs, 0);
+            for (size_t idx : order) {
+                size_t target = std::min_element(load.begin(), load.end()) - load.begin();
+                buckets[target].push_back(idx);
+                // Count a fixed cost per file so thousands of tiny files are spread out too
+                load[target] += tasks[idx].data.size() + 4096;
+            }
+            std::vector<std::thread> workers;
+            workers.reserve(jobs);
+            for (auto& bucket : buckets) {
+                workers.emplace_back([&run, &bucket] {
+                    for (size_t idx : bucket) {
+                        run(idx);
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+        std::sort(failures.begin(), failures.end(), [](const write_failure& a, const write_failure& b) {
+            return a.task_index < b.task_index;
+        });
+        return failures;
+    }
+
+    void read_in_order(const std::vector<read_request>& requests, unsigned readers,
+        const std::function<void(size_t request, uint64_t offset, std::span<const unsigned char> data)>& consume) {
+        std::vector<chunk_t> chunks = split_requests(requests);
+
+        if (readers == 0) {
+            readers = std::max(1u, std::thread::hardware_concurrency());
+        }
+        // Two buffers per reader keep every reader busy while the consumer drains
+        const size_t slot_count = std::min<size_t>(size_t(readers) * 2, std::max<size_t>(chunks.size(), 1));
+        struct slot_t {
+            std::vector<unsigned char> buffer;
+            size_t chunk = SIZE_MAX; // chunk currently held, SIZE_MAX while empty
+            std::exception_ptr error;
+        };
+        std::vector<slot_t> slots(slot_count);
+        std::mutex mutex;
+        std::condition_variable slot_filled;
+        std::condition_variable slot_freed;
+        size_t consumed = 0; // chunks handed to consume so far
+        bool abort = false;
+        std::atomic<size_t> next_chunk{ 0 };
+
+        auto reader = [&] {
+            for (;;) {
+                size_t c = next_chunk.fetch_add(1);
+                if (c >= chunks.size()) return;
+                slot_t& slot = slots[c % slot_count];
+                {
+                    std::unique_lock lock(mutex);
+                    slot_freed.wait(lock, [&] { return abort || c < consumed + slot_count; });
+                    if (abort) return;
+                }
+                std::exception_ptr error;
+                try {
+                    trace::scope phase("read_chunk");
+                    io_slot io;
+                    const chunk_t& chunk = chunks[c];
+                    const read_request& request = requests[chunk.request];
+                    slot.buffer.resize(chunk.length);
+                    trace::add(trace::counter::open_calls);
+                    HANDLE file = CreateFile(
+                        request.path.c_str(),
+                        GENERIC_READ,
+                        FILE_SHARE_READ,
+                        NULL,
+                        OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                        NULL
+                    );
+                    if (file == INVALID_HANDLE_VALUE) {
+                        throw std::runtime_error("Failed to open file: " + request.path.string());
+                    }
+                    LARGE_INTEGER liOffset;
+                    liOffset.QuadPart = (LONGLONG)(request.offset + chunk.offset);
+                    uint32_t filled = 0;
+                    bool ok = SetFilePointerEx(file, liOffset, NULL, FILE_BEGIN);
+                    while (ok && filled < chunk.length) {
+                        DWORD read = 0;
+                        ok = ReadFile(file, slot.buffer.data() + filled, chunk.length - filled, &read, NULL) && read > 0;
+                        filled += read;
+                        trace::add(trace::counter::read_calls);
+                    }
+                    CloseHandle(file);
+                    if (!ok) {
+                        throw std::runtime_error("Failed to read file: " + request.path.string());
+                    }
+                    trace::add(trace::counter::seek_calls);
+                    trace::add(trace::counter::bytes_read, filled);
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+                {
+                    std::lock_guard lock(mutex);
+                    slot.error = error;
+                    slot.chunk = c;
+                }
+                slot_filled.notify_all();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(readers);
+        for (unsigned r = 0; r < readers; ++r) {
+            workers.emplace_back(reader);
+        }
+        auto stop = [&] {
+            {
+                std::lock_guard lock(mutex);
+                abort = true;
+            }
+            slot_freed.notify_all();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        };
+
+        try {
+            for (size_t c = 0; c < chunks.size(); ++c) {
+                slot_t& slot = slots[c % slot_count];
+                {
+                    std::unique_lock lock(mutex);
+                    slot_filled.wait(lock, [&] { return slot.chunk == c; });
+                }
+                if (slot.error) {
+                    std::rethrow_exception(slot.error);
+                }
+                consume(chunks[c].request, chunks[c].offset, slot.buffer);
+                {
+                    std::lock_guard lock(mutex);
+                    slot.chunk = SIZE_MAX;
+                    ++consumed;
+                }
+                slot_freed.notify_all();
+            }
+        }
+        catch (...) {
+            stop();
+            throw;
+        }
+        stop();
+    }
+
+    namespace {
+        // Completion port shared by all files of one batch. Files attached to it
+        // report operations that finish right away from the call itself and only
+        // the ones that really wait come through the port.
+        class completion_port {
+        public:
+            completion_port() {
+                m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+                if (m_port == NULL) {
+                    throw std::runtime_error("Failed to create completion port");
+                }
+            }
+            ~completion_port() { CloseHandle(m_port); }
+            completion_port(const completion_port&) = delete;
+            completion_port& operator=(const completion_port&) = delete;
+
+            bool attach(HANDLE file) {
+                return CreateIoCompletionPort(file, m_port, 0, 0) != NULL &&
+                    SetFileCompletionNotificationModes(file, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS | FILE_SKIP_SET_EVENT_ON_HANDLE);
+            }
+            // Blocks until at least one operation finished and hands every
+            // finished OVERLAPPED of the batch to `done`
+            template<typename F>
+            void wait(F&& done) {
+                OVERLAPPED_ENTRY entries[64];
+                ULONG removed = 0;
+                if (!GetQueuedCompletionStatusEx(m_port, entries, 64, &removed, INFINITE, FALSE)) {
+                    throw std::runtime_error("Failed to wait for completion port");
+                }
+                for (ULONG i = 0; i < removed; ++i) {
+                    done(entries[i].lpOverlapped);
+                }
+            }
+        private:
+            HANDLE m_port;
+        };
+
+        // Starts an overlapped read or write of `length` bytes at `offset`.
+        // Returns false when it finished already, true while it is pending.
+        bool start_overlapped(HANDLE file, OVERLAPPED& overlapped, bool write, void* buffer, DWORD length, uint64_t offset) {
+            overlapped = {};
+            overlapped.Offset = (DWORD)offset;
+            overlapped.OffsetHigh = (DWORD)(offset >> 32);
+            trace::add(write ? trace::counter::write_calls : trace::counter::read_calls);
+            BOOL ok = write ? WriteFile(file, buffer, length, NULL, &overlapped) : ReadFile(file, buffer, length, NULL, &overlapped);
+            if (ok) {
+                return false;
+            }
+            if (GetLastError() == ERROR_IO_PENDING) {
+                return true;
+            }
+            throw std::runtime_error(write ? "Failed to write file" : "Failed to read file");
+        }
+
+        DWORD overlapped_result(HANDLE file, OVERLAPPED& overlapped, bool write) {
+            DWORD transferred = 0;
+            if (!GetOverlappedResult(file, &overlapped, &transferred, FALSE)) {
+                throw std::runtime_error(write ? "Failed to write file" : "Failed to read file");
+            }
+            trace::add(write ? trace::counter::bytes_written : trace::counter::bytes_read, transferred);
+            return transferred;
+        }
+    }
+
+    std::vector<write_failure> write_files_overlapped(const std::vector<write_task>& tasks, unsigned queue_depth) {
+        io_slot io;
+        std::vector<write_failure> failures;
+        std::vector<size_t> order = prepare_write_tasks(tasks);
+
+        struct operation {
+            OVERLAPPED overlapped;
+            HANDLE file;
+            size_t task;
+            uint64_t written;
+        };
+        completion_port port;
+        std::vector<operation> operations(std::max(1u, queue_depth));
+        std::vector<operation*> idle;
+        for (auto& op : operations) {
+            idle.push_back(&op);
+        }
+        size_t in_flight = 0;
+
+        auto finish = [&](operation& op, const std::string& error) {
+            CloseHandle(op.file);
+            if (!error.empty()) {
+                failures.push_back({ op.task, error + ": " + tasks[op.task].output_path.string() });
+            }
+            idle.push_back(&op);
+        };
+        // Writes until a write has to wait for the disk or the file is done
+        auto advance = [&](operation& op) {
+            try {
+                auto data = tasks[op.task].data;
+                while (op.written < data.size()) {
+                    DWORD length = (DWORD)std::min<uint64_t>(data.size() - op.written, COPY_CHUNK_SIZE);
+                    if (start_overlapped(op.file, op.overlapped, true, (void*)(data.data() + op.written), length, op.written)) {
+                        ++in_flight;
+                        return;
+                    }
+                    op.written += overlapped_result(op.file, op.overlapped, true);
+                }
+                finish(op, "");
+            }
+            catch (const std::exception& e) {
+                finish(op, e.what());
+            }
+        };
+
+        size_t next = 0;
+        while (next < order.size() || in_flight > 0) {
+            while (!idle.empty() && next < order.size()) {
+                operation& op = *idle.back();
+                idle.pop_back();
+                op.task = order[next++];
+                op.written = 0;
+                trace::add(trace::counter::open_calls);
+                op.file = CreateFile(
+                    tasks[op.task].output_path.c_str(),
+                    GENERIC_WRITE,
+                    0,
+                    NULL,
+                    CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
+                    NULL
+                );
+                if (op.file == INVALID_HANDLE_VALUE) {
+                    failures.push_back({ op.task, "Failed to create output file: " + tasks[op.task].output_path.string() });
+                    idle.push_back(&op);
+                    continue;
+                }
+                if (!port.attach(op.file)) {
+                    finish(op, "Failed to attach file to completion port");
+                    continue;
+                }
+                advance(op);
+            }
+            if (in_flight > 0) {
+                port.wait([&](OVERLAPPED* overlapped) {
+                    operation& op = *CONTAINING_RECORD(overlapped, operation, overlapped);
+                    --in_flight;
+                    try {
+                        op.written += overlapped_result(op.file, op.overlapped, true);
+                    }
+                    catch (const std::exception& e) {
+                        finish(op, e.what());
+                        return;
+                    }
+                    advance(op);
+                });
+            }
+        }
+
+        std::sort(failures.begin(), failures.end(), [](const write_failure& a, const write_failure& b) {
+            return a.task_index < b.task_index;
+        });
+        return failures;
+    }
+
+    void read_in_order_overlapped(const std::vector<read_request>& requests, unsigned queue_depth,
+        const std::function<void(size_t request, uint64_t offset, std::span<const unsigned char> data)>& consume) {
+        io_slot io;
+        std::vector<chunk_t> chunks = split_requests(requests);
+
+        struct operation {
+            OVERLAPPED overlapped;
+            size_t chunk;
+            bool done;
+            std::exception_ptr error;
+            std::vector<unsigned char> buffer;
+        };
+        const size_t slot_count = std::min<size_t>(std::max(1u, queue_depth), std::max<size_t>(chunks.size(), 1));
+        std::vector<operation> operations(slot_count);
+        std::vector<HANDLE> files(requests.size(), INVALID_HANDLE_VALUE);
+        completion_port port;
+        size_t in_flight = 0;
+        uint64_t bytes_in_flight = 0; // read ahead but not consumed yet
+
+        auto complete = [&](operation& op) {
+            const chunk_t& chunk = chunks[op.chunk];
+            try {
+                if (overlapped_result(files[chunk.request], op.overlapped, false) != chunk.length) {
+                    throw std::runtime_error("Unexpected end of file");
+                }
+            }
+            catch (const std::exception& e) {
+                op.error = std::make_exception_ptr(std::runtime_error(std::string(e.what()) + ": " + requests[chunk.request].path.string()));
+            }
+            op.done = true;
+        };
+        auto submit = [&](size_t c) {
+            const chunk_t& chunk = chunks[c];
+            const read_request& request = requests[chunk.request];
+            operation& op = operations[c % slot_count];
+            op.chunk = c;
+            op.done = false;
+            op.error = nullptr;
+            op.buffer.resize(chunk.length);
+            bytes_in_flight += chunk.length;
+            HANDLE& file = files[chunk.request];
+            if (chunk.offset == 0) {
+                trace::add(trace::counter::open_calls);
+                file = CreateFile(
+                    request.path.c_str(),
+                    GENERIC_READ,
+                    FILE_SHARE_READ,
+                    NULL,
+                    OPEN_EXISTING,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED,
+                    NULL
+                );
+                if (file == INVALID_HANDLE_VALUE) {
+                    throw std::runtime_error("Failed to open file: " + request.path.string());
+                }
+                if (!port.attach(file)) {
+                    throw std::runtime_error("Failed to attach file to completion port: " + request.path.string());
+                }
+            }
+            if (chunk.length == 0) {
+                op.done = true;
+                return;
+            }
+            try {
+                if (start_overlapped(file, op.overlapped, false, op.buffer.data(), chunk.length, request.offset + chunk.offset)) {
+                    ++in_flight;
+                    return;
+                }
+            }
+            catch (const std::exception& e) {
+                throw std::runtime_error(std::string(e.what()) + ": " + request.path.string());
+            }
+            complete(op);
+        };
+        auto close_files = [&] {
+            for (HANDLE& file : files) {
+                if (file != INVALID_HANDLE_VALUE) {
+                    CloseHandle(file);
+                    file = INVALID_HANDLE_VALUE;
+                }
+            }
+        };
+
+        try {
+            size_t submitted = 0;
+            for (size_t c = 0; c < chunks.size();) {
+                while (submitted < chunks.size() && submitted < c + slot_count &&
+                    (bytes_in_flight == 0 || bytes_in_flight + chunks[submitted].length <= MAX_BYTES_IN_FLIGHT)) {
+                    submit(submitted++);
+                }
+                operation& op = operations[c % slot_count];
+                if (!op.done) {
+                    port.wait([&](OVERLAPPED* overlapped) {
+                        --in_flight;
+                        complete(*CONTAINING_RECORD(overlapped, operation, overlapped));
+                    });
+                    continue;
+                }
+                if (op.error) {
+                    std::rethrow_exception(op.error);
+                }
+                const chunk_t& chunk = chunks[c];
+                consume(chunk.request, chunk.offset, op.buffer);
+                bytes_in_flight -= chunk.length;
+                if (chunk.offset + chunk.length == requests[chunk.request].length) {
+                    CloseHandle(files[chunk.request]);
+                    files[chunk.request] = INVALID_HANDLE_VALUE;
+                }
+                ++c;
+            }
+        }
+        catch (...) {
+            // The buffers must outlive every read still queued
+            for (HANDLE file : files) {
+                if (file != INVALID_HANDLE_VALUE) {
+                    CancelIoEx(file, NULL);
+                }
+            }
+            while (in_flight > 0) {
+                port.wait([&](OVERLAPPED*) { --in_flight; });
+            }
+            close_files();
+            throw;
+        }
+        close_files();
+    }
+}
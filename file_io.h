@@ -0,0 +1,111 @@
+#pragma once
+
+#include <filesystem>
+#include <span>
+#include <string>
+#include <vector>
+#include <functional>
+#include <initializer_list>
+#include <cstdint>
+#include <windows.h>
+
+namespace fs = std::filesystem;
+
+namespace file_io {
+    // Read-only mapping of a whole file. Either opens the file itself or maps
+    // an already opened handle (the handle then stays owned by the caller).
+    class mapped_file {
+    public:
+        mapped_file() = default;
+        explicit mapped_file(const fs::path& path);
+        explicit mapped_file(HANDLE file);
+        ~mapped_file();
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+        mapped_file(mapped_file&& other) noexcept;
+        mapped_file& operator=(mapped_file&& other) noexcept;
+
+        explicit operator bool() const { return m_file != INVALID_HANDLE_VALUE; }
+        const unsigned char* data() const { return m_data; }
+        uint64_t size() const { return m_size; }
+        HANDLE handle() const { return m_file; }
+        std::span<const unsigned char> bytes(uint64_t offset, uint64_t length) const;
+    private:
+        void _map(HANDLE file);
+        void _release() noexcept;
+    private:
+        HANDLE m_file = INVALID_HANDLE_VALUE;
+        bool m_owns_file = false;
+        HANDLE m_mapping = NULL;
+        const unsigned char* m_data = nullptr;
+        uint64_t m_size = 0;
+    };
+
+    // Size of one streamed read/write. Copies never hold more than this per thread.
+    const size_t COPY_CHUNK_SIZE = 1024 * 1024 * 4;
+    // Most bytes read_in_order_overlapped buffers ahead of its consumer.
+    const uint64_t MAX_BYTES_IN_FLIGHT = 1024 * 1024 * 64;
+
+    // Caps the reads and writes in flight at once across every thread of the
+    // process, 0 (the default) lifts the cap. Blocking calls take a slot per
+    // chunk and an overlapped queue takes one for its whole run. A thread that
+    // already holds a slot does not wait for a second one.
+    void set_io_limit(unsigned max_concurrent);
+
+    // Writes the whole span in COPY_CHUNK_SIZE pieces.
+    void write_all(HANDLE file, std::span<const unsigned char> data);
+    // Copies `length` bytes of `src` starting at `src_offset` to the current
+    // position of `dst`. Any size is fine, memory use stays at one chunk.
+    void copy_range(HANDLE src, uint64_t src_offset, HANDLE dst, uint64_t length);
+
+    // Cluster size if the volume of `file` can share blocks between files
+    // (ReFS, Dev Drive), 0 otherwise.
+    uint32_t block_clone_granularity(HANDLE file);
+    // Like copy_range, but the cluster aligned part of the range is cloned by
+    // the file system when src and dst allow it (same block cloning volume and
+    // src_offset - dst_offset a multiple of the cluster size), so no data goes
+    // through memory. Everything else falls back to the buffered copy. dst's
+    // file pointer ends up behind the copied range. `cluster` is
+    // block_clone_granularity(dst), queried once per destination by the caller.
+    void clone_range(HANDLE src, uint64_t src_offset, HANDLE dst, uint64_t dst_offset, uint64_t length, uint32_t cluster);
+    // Creates (or truncates) path and writes data into it.
+    void write_file(const fs::path& path, std::span<const unsigned char> data);
+    // Same, for data held in several buffers: the parts are written back to
+    // back through one handle instead of being joined in memory first.
+    void write_file(const fs::path& path, std::initializer_list<std::span<const unsigned char>> parts);
+
+    struct write_task {
+        std::span<const unsigned char> data;
+        fs::path output_path;
+    };
+    struct write_failure {
+        size_t task_index;
+        std::string message;
+    };
+    // Writes every task to its own file. The directory tree is created once up
+    // front and the tasks are split by size across `jobs` threads (0 picks the
+    // hardware concurrency). When several tasks target the same path, compared
+    // case-insensitively like NTFS does, only the first one is written, the
+    // same entry a front to back search of the archive finds.
+    std::vector<write_failure> write_files(const std::vector<write_task>& tasks, unsigned jobs = 1);
+
+    struct read_request {
+        fs::path path;
+        uint64_t offset;
+        uint64_t length;
+    };
+    // Reads every request in COPY_CHUNK_SIZE pieces on `readers` threads into a
+    // bounded ring of buffers, while the calling thread hands the pieces to
+    // `consume` strictly in request order. An empty request is delivered as a
+    // single empty piece. The first error stops the readers and is rethrown.
+    void read_in_order(const std::vector<read_request>& requests, unsigned readers,
+        const std::function<void(size_t request, uint64_t offset, std::span<const unsigned char> data)>& consume);
+
+    // Overlapped I/O backends for archives with many small files. A single
+    // thread keeps up to `queue_depth` reads or writes queued on a completion
+    // port and collects finished ones in batches, instead of a thread blocking
+    // on every file. Same results and errors as the thread based versions.
+    std::vector<write_failure> write_files_overlapped(const std::vector<write_task>& tasks, unsigned queue_depth = 64);
+    void read_in_order_overlapped(const std::vector<read_request>& requests, unsigned queue_depth,
+        const std::function<void(size_t request, uint64_t offset, std::span<const unsigned char> data)>& consume);
+}
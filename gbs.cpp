@@ -1,18 +1,173 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "reader_writer.h"
 #include "gbs.h"
+#include "byte_order.h"
+#include "file_io.h"
 #include <cmath>
 #include <stdexcept>
 #include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <span>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <smmintrin.h>
+#define GBS_SSE41
+#endif
 
 namespace fs = std::filesystem;
 
 namespace gbs {
 
+namespace {
+    uint32_t get_u32(const std::vector<unsigned char>& buffer, size_t offset, bool big_endian) {
+        return big_endian ? byte_order::load_be<uint32_t>(buffer, offset) : byte_order::load_le<uint32_t>(buffer, offset);
+    }
+
+    void get_u32_array(const std::vector<unsigned char>& buffer, size_t offset, std::span<uint32_t> values, bool big_endian) {
+        if (big_endian) {
+            byte_order::load_be_array(buffer, offset, values);
+        }
+        else {
+            byte_order::load_le_array(buffer, offset, values);
+        }
+    }
+
+    // Four-byte tags are read as a number and kept in little-endian order
+    std::string get_tag(const std::vector<unsigned char>& buffer, size_t offset, bool big_endian) {
+        std::string tag(4, '\0');
+        byte_order::store_le(reinterpret_cast<unsigned char*>(tag.data()), get_u32(buffer, offset, big_endian));
+        return tag;
+    }
+
+    unsigned char* put_u32(unsigned char* out, uint32_t value, bool big_endian) {
+        if (big_endian) {
+            byte_order::store_be(out, value);
+        }
+        else {
+            byte_order::store_le(out, value);
+        }
+        return out + 4;
+    }
+
+    template<size_t N>
+    unsigned char* put_u32_array(unsigned char* out, const uint32_t (&values)[N], bool big_endian) {
+        if (big_endian) {
+            byte_order::store_be_array(out, values, N);
+        }
+        else {
+            byte_order::store_le_array(out, values, N);
+        }
+        return out + N * 4;
+    }
+
+    // Glyph codes and other tags are four bytes, compared as one number
+    uint32_t code_key(const std::string& code) {
+        unsigned char bytes[4]{};
+        std::memcpy(bytes, code.data(), std::min<size_t>(code.size(), 4));
+        return byte_order::load_le<uint32_t>(bytes);
+    }
+
+    unsigned char* put_tag(unsigned char* out, const std::string& tag, bool big_endian) {
+        return put_u32(out, code_key(tag), big_endian);
+    }
+
+    using rounding = glyph_transform::rounding;
+
+    template<rounding mode>
+    uint32_t transform_value(uint32_t value, double scale, double offset) {
+        double result = std::max(double(value) * scale + offset, 0.0);
+        if constexpr (mode == rounding::nearest) {
+            result = std::round(result);
+        }
+        else if constexpr (mode == rounding::down) {
+            result = std::floor(result);
+        }
+        else {
+            result = std::ceil(result);
+        }
+        return (uint32_t)std::min(result, 4294967295.0);
+    }
+
+#ifdef GBS_SSE41
+    // Same math as transform_value, two values at a time
+    template<rounding mode>
+    size_t transform_column_sse41(uint32_t* values, size_t count, double scale, double offset) {
+        const __m128i sign = _mm_set1_epi32(INT32_MIN);
+        const __m128d bias = _mm_set1_pd(2147483648.0);
+        const __m128d scale_v = _mm_set1_pd(scale);
+        const __m128d offset_v = _mm_set1_pd(offset);
+        const __m128d zero = _mm_setzero_pd();
+        const __m128d half = _mm_set1_pd(0.5);
+        const __m128d one = _mm_set1_pd(1.0);
+        const __m128d max = _mm_set1_pd(4294967295.0);
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2) {
+            __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(values + i));
+            // Unsigned to double: flip the sign bit, convert as signed, add 2^31 back
+            __m128d value = _mm_add_pd(_mm_cvtepi32_pd(_mm_xor_si128(packed, sign)), bias);
+            __m128d result = _mm_max_pd(_mm_add_pd(_mm_mul_pd(value, scale_v), offset_v), zero);
+            if constexpr (mode == rounding::nearest) {
+                __m128d whole = _mm_round_pd(result, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+                __m128d up = _mm_cmpge_pd(_mm_sub_pd(result, whole), half);
+                result = _mm_add_pd(whole, _mm_and_pd(up, one));
+            }
+            else if constexpr (mode == rounding::down) {
+                result = _mm_floor_pd(result);
+            }
+            else {
+                result = _mm_ceil_pd(result);
+            }
+            result = _mm_min_pd(result, max);
+            packed = _mm_xor_si128(_mm_cvttpd_epi32(_mm_sub_pd(result, bias)), sign);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(values + i), packed);
+        }
+        return i;
+    }
+
+    bool cpu_has_sse41() {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 19)) != 0;
+    }
+    const bool HAS_SSE41 = cpu_has_sse41();
+#endif
+
+    template<rounding mode>
+    void transform_column(uint32_t* values, size_t count, const glyph_transform::axis& along) {
+        size_t i = 0;
+#ifdef GBS_SSE41
+        if (HAS_SSE41) {
+            i = transform_column_sse41<mode>(values, count, along.scale, along.offset);
+        }
+#endif
+        for (; i < count; ++i) {
+            values[i] = transform_value<mode>(values[i], along.scale, along.offset);
+        }
+    }
+
+    void transform_column(uint32_t* values, size_t count, const glyph_transform::axis& along, rounding mode) {
+        switch (mode) {
+        case rounding::nearest: return transform_column<rounding::nearest>(values, count, along);
+        case rounding::down: return transform_column<rounding::down>(values, count, along);
+        case rounding::up: return transform_column<rounding::up>(values, count, along);
+        }
+    }
+
+    // Fixed size field: longer strings are cut, shorter ones padded with zeros
+    unsigned char* put_string(unsigned char* out, const std::string& value, size_t field) {
+        std::memcpy(out, value.data(), std::min(value.size(), field));
+        return out + field;
+    }
+}
+
 gbs_t::gbs_t(const fs::path pathtoread) {
     try {
         std::fstream File;
-        File.open(pathtoread, std::ios::out | std::ios::in | std::ios::binary | std::ios::ate);
+        File.open(pathtoread, std::ios::in | std::ios::binary | std::ios::ate);
         if (File.is_open()) {
             auto size = File.tellg();
             File.seekg(0);
@@ -20,7 +175,7 @@ gbs_t::gbs_t(const fs::path pathtoread) {
             File.read(reinterpret_cast<char*>(file_buffer.data()), size);
             _read();
         }
-        else throw std::runtime_error("Could not open file");
+        else throw std::runtime_error("Failed to open scene: " + pathtoread.string());
     }
     catch (...) {
         throw;
@@ -28,246 +183,426 @@ gbs_t::gbs_t(const fs::path pathtoread) {
 }
 
 void gbs_t::_read() {
-    m_gbsc_header = reader::readBuffer_VectorUnChar_to_String(file_buffer, 0, 4);
-    m_file_size = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 4);
-    m_data_version = reader::readBuffer_VectorUnChar_to_String(file_buffer, 8, 8);
-    m_scene_id = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 16);
-    m_fonts_count = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 20);
-    m_textures_count = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 24);
-    m_sounds_count = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 28);
-    m_views_count = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 32);
-    m_messages_count = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 36);
-    m_fonts_offset = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 40);
-    m_textures_offset = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 44);
-    m_sounds_offset = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 48);
-    m_view_offset = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 52);
-    m_messages_offset = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, 56);
-
-    size_t ptr = m_fonts_offset;
+    m_big_endian = reader::readBuffer_VectorUnChar_to_String(file_buffer, 0, 4) == "GGSC";
+    const bool be = m_big_endian;
+    m_gbsc_header = get_tag(file_buffer, 0, be);
+    m_file_size = get_u32(file_buffer, 4, be);
+    m_data_version = get_tag(file_buffer, 8, be);
+    uint32_t header[11];
+    get_u32_array(file_buffer, 12, header, be);
+    m_scene_id = header[0];
+    m_fonts_count = header[1];
+    m_textures_count = header[2];
+    m_sounds_count = header[3];
+    m_views_count = header[4];
+    m_messages_count = header[5];
+    m_fonts_offset = header[6];
+    m_textures_offset = header[7];
+    m_sounds_offset = header[8];
+    m_view_offset = header[9];
+    m_messages_offset = header[10];
+
+    size_t ptr = HEADER_SIZE + m_fonts_offset;
     for (uint32_t i = 0; i < m_fonts_count; i++) {
-        m_fonts.push_back(font_t(file_buffer, ptr));
+        m_fonts.push_back(font_t(file_buffer, ptr, be));
         ptr += m_fonts.back().size();
     }
-    ptr = m_textures_offset;
+    ptr = HEADER_SIZE + m_textures_offset;
     for (uint32_t i = 0; i < m_textures_count; i++) {
-        m_textures.push_back(texture_t(file_buffer, ptr));
+        m_textures.push_back(texture_t(file_buffer, ptr, be));
         ptr += m_textures.back().size();
     }
+    m_tail_offset = ptr;
 }
 
-gbs_t::font_t::font_t(std::vector<unsigned char>& buffer, size_t ptr) {
+gbs_t::font_t::font_t(const std::vector<unsigned char>& buffer, size_t ptr, bool big_endian) {
     try {
-        _read(buffer, ptr);
+        _read(buffer, ptr, big_endian);
     }
     catch (...) {
         throw;
     }
 }
 
-void gbs_t::font_t::_read(std::vector<unsigned char>& file_buffer, size_t ptr) {
-    m_gfnt_lable = reader::readBuffer_VectorUnChar_to_String(file_buffer, ptr, 4);
-    m_font_lenght = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 4);
-    m_font_id = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 8);
+void gbs_t::font_t::_read(const std::vector<unsigned char>& file_buffer, size_t ptr, bool big_endian) {
+    m_gfnt_lable = get_tag(file_buffer, ptr, big_endian);
+    m_font_lenght = get_u32(file_buffer, ptr + 4, big_endian);
+    m_font_id = get_u32(file_buffer, ptr + 8, big_endian);
     m_font_name = reader::readBuffer_VectorUnChar_to_String(file_buffer, ptr + 12, 64);
-    m_font_size = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 76);
-    m_atlas_w = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 80);
-    m_atlas_h = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 84);
-    m_max_top = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 88);
-    m_atlas_count = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 92);
-    uint32_t l_chars = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 96);
+    m_font_size = get_u32(file_buffer, ptr + 76, big_endian);
+    m_atlas_w = get_u32(file_buffer, ptr + 80, big_endian);
+    m_atlas_h = get_u32(file_buffer, ptr + 84, big_endian);
+    m_max_top = get_u32(file_buffer, ptr + 88, big_endian);
+    m_atlas_count = get_u32(file_buffer, ptr + 92, big_endian);
+    uint32_t l_chars = get_u32(file_buffer, ptr + 96, big_endian);
     m_chars_count = l_chars;
     size_t ptr_f = ptr + 100;
     for (uint32_t i = 0; i < l_chars; i++) {
-        m_chars.push_back(char_t(file_buffer, ptr_f));
+        m_chars.push_back(char_t(file_buffer, ptr_f, big_endian));
         ptr_f += 0x28;
     }
 }
 
-gbs_t::char_t::char_t(std::vector <unsigned char>& file_buffer, size_t ptr_f) {
+gbs_t::char_t::char_t(const std::vector<unsigned char>& file_buffer, size_t ptr_f, bool big_endian) {
     try {
-        _read(file_buffer, ptr_f);
+        _read(file_buffer, ptr_f, big_endian);
     }
     catch (...) {
         throw;
     }
 }
 
-void gbs_t::char_t::_read(std::vector <unsigned char>& file_buffer, size_t ptr) {
-    m_char_code = reader::readBuffer_VectorUnChar_to_String(file_buffer, ptr, 4);
-    m_is_image_glyph = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 4);
-    m_char_x_offset = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 8);
-    m_char_y_offset = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 12);
-    m_char_w = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 16);
-    m_char_h = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 20);
-    m_char_top = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 24);
-    m_char_advance = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 28);
-    m_char_left_bearning = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 32);
-    m_char_atlas_index = reader::LE_readBuffer_VectorUnChar_to_UnInt32(file_buffer, ptr + 36);
+void gbs_t::char_t::_read(const std::vector<unsigned char>& file_buffer, size_t ptr, bool big_endian) {
+    m_char_code = get_tag(file_buffer, ptr, big_endian);
+    // The nine fields after the code are read as one run
+    uint32_t fields[9];
+    get_u32_array(file_buffer, ptr + 4, fields, big_endian);
+    m_is_image_glyph = fields[0];
+    m_char_x_offset = fields[1];
+    m_char_y_offset = fields[2];
+    m_char_w = fields[3];
+    m_char_h = fields[4];
+    m_char_top = fields[5];
+    m_char_advance = fields[6];
+    m_char_left_bearning = fields[7];
+    m_char_atlas_index = fields[8];
 }
 
-gbs_t::texture_t::texture_t(std::vector<unsigned char>& buffer, size_t ptr) {
+gbs_t::texture_t::texture_t(const std::vector<unsigned char>& buffer, size_t ptr, bool big_endian) {
     try {
-        _read(buffer, ptr);
+        _read(buffer, ptr, big_endian);
     }
     catch (...) {
         throw;
     }
 }
 
-void gbs_t::texture_t::_read(std::vector<unsigned char>& file_buffer, size_t ptr) {
-    m_id = (uint16_t)(file_buffer[ptr] + (file_buffer[ptr + 1] << 8));
-    m_type = (uint16_t)(file_buffer[ptr + 2] + (file_buffer[ptr + 3] << 8));
+void gbs_t::texture_t::_read(const std::vector<unsigned char>& file_buffer, size_t ptr, bool big_endian) {
+    // The id is the low half of one number, the type the high one
+    uint32_t id_type = get_u32(file_buffer, ptr, big_endian);
+    m_id = uint16_t(id_type);
+    m_type = uint16_t(id_type >> 16);
     m_path = reader::readBuffer_VectorUnChar_to_String(file_buffer, ptr + 4, 260);
+    get_u32_array(file_buffer, ptr + 264, m_coords, big_endian);
 }
  
+size_t gbs_t::_serialized_size() const {
+    size_t size = HEADER_SIZE + m_textures.size() * TEXTURE_SIZE;
+    for (const auto& font : m_fonts) {
+        size += FONT_HEADER_SIZE + font.chars().size() * CHAR_SIZE;
+    }
+    return size;
+}
+
 void gbs_t::write(fs::path const pathtowrite) {
-    std::ofstream export_file(pathtowrite, std::ios::out | std::ios::binary);
-    if (!export_file.is_open()) {
-        throw std::runtime_error("Could not open file for writing");
-    }
-    std::vector<unsigned char> buffer;
-    writer::appendString(buffer, m_gbsc_header);
-    writer::appendLE32(buffer, m_file_size);
-    writer::appendString(buffer, m_data_version);
-    writer::appendLE32(buffer, uint32_t(m_scene_id));
-    writer::appendLE32(buffer, uint32_t(m_fonts_count));
-    writer::appendLE32(buffer, uint32_t(m_textures_count));
-    writer::appendLE32(buffer, uint32_t(m_sounds_count));
-    writer::appendLE32(buffer, uint32_t(m_views_count));
-    writer::appendLE32(buffer, uint32_t(m_messages_count));
-    writer::appendLE32(buffer, uint32_t(m_fonts_offset));
-    writer::appendLE32(buffer, uint32_t(m_textures_offset));
-    writer::appendLE32(buffer, uint32_t(m_sounds_offset));
-    writer::appendLE32(buffer, uint32_t(m_view_offset));
-    writer::appendLE32(buffer, uint32_t(m_messages_offset));
+    // The header, fonts and textures are laid out in one exactly sized buffer,
+    // the rest of the scene goes out straight from file_buffer behind it
+    std::vector<unsigned char> buffer(_serialized_size());
+    unsigned char* out = buffer.data();
+    const bool be = m_big_endian;
+    out = put_tag(out, m_gbsc_header, be);
+    out = put_u32(out, m_file_size, be);
+    out = put_tag(out, m_data_version, be);
+    const uint32_t header[] = { m_scene_id, m_fonts_count, m_textures_count, m_sounds_count, m_views_count, m_messages_count,
+        m_fonts_offset, m_textures_offset, m_sounds_offset, m_view_offset, m_messages_offset };
+    out = put_u32_array(out, header, be);
     for (const auto& font : m_fonts) {
-        writer::appendString(buffer, font.gfnt_lable());
-        writer::appendLE32(buffer, font.font_lenght());
-        writer::appendLE32(buffer, font.font_id());
-        writer::appendString(buffer, font.font_name());
-        writer::appendLE32(buffer, font.font_size());
-        writer::appendLE32(buffer, font.atlas_w());
-        writer::appendLE32(buffer, font.atlas_h());
-        writer::appendLE32(buffer, font.max_top());
-        writer::appendLE32(buffer, font.atlas_count());
-        writer::appendLE32(buffer, font.chars_count());
+        out = put_tag(out, font.gfnt_lable(), be);
+        out = put_u32(out, font.font_lenght(), be);
+        out = put_u32(out, font.font_id(), be);
+        out = put_string(out, font.font_name(), 64);
+        const uint32_t metrics[] = { font.font_size(), font.atlas_w(), font.atlas_h(), font.max_top(), font.atlas_count(), font.chars_count() };
+        out = put_u32_array(out, metrics, be);
         for (const auto& letter : font.chars()) {
-            writer::appendString(buffer, letter.char_code());
-            writer::appendLE32(buffer, letter.is_image_glyph());
-            writer::appendLE32(buffer, letter.char_x_offset());
-            writer::appendLE32(buffer, letter.char_y_offset());
-            writer::appendLE32(buffer, letter.char_w());
-            writer::appendLE32(buffer, letter.char_h());
-            writer::appendLE32(buffer, letter.char_top());
-            writer::appendLE32(buffer, letter.char_advance());
-            writer::appendLE32(buffer, letter.char_left_bearning());
-            writer::appendLE32(buffer, letter.char_atlas_index());
+            out = put_tag(out, letter.char_code(), be);
+            const uint32_t fields[] = { letter.is_image_glyph(), letter.char_x_offset(), letter.char_y_offset(), letter.char_w(), letter.char_h(),
+                letter.char_top(), letter.char_advance(), letter.char_left_bearning(), letter.char_atlas_index() };
+            out = put_u32_array(out, fields, be);
         }
     }
     for (const auto& texture : m_textures) {
-        writer::appendLE16(buffer, texture.id());
-        writer::appendLE16(buffer, texture.type());
-        writer::appendString(buffer, texture.path());
-        writer::appendLE16(buffer, texture.id());
-        writer::appendLE16(buffer, texture.type());
+        out = put_u32(out, uint32_t(texture.id()) | uint32_t(texture.type()) << 16, be);
+        out = put_string(out, texture.path(), 260);
+        const uint32_t coords[] = { texture.coords()[0], texture.coords()[1], texture.coords()[2], texture.coords()[3], texture.coords()[4] };
+        out = put_u32_array(out, coords, be);
+    }
 
-        writer::appendLE64(buffer, 0);
+    std::span<const unsigned char> tail(file_buffer);
+    tail = tail.subspan(std::min(m_tail_offset, tail.size()));
+    file_io::write_file(pathtowrite, { buffer, tail });
+}
 
-        writer::appendLE16(buffer, 0);
-        writer::appendLE16(buffer, uint16_t(0x3f80));
-        writer::appendLE16(buffer, 0);
-        writer::appendLE16(buffer, uint16_t(0x3f80));
+gbs_view::gbs_view(const fs::path& path) : m_file(path) {
+    const uint64_t size = m_file.size();
+    auto damaged = [&] { return std::runtime_error("GBS file is damaged: " + path.string()); };
+    if (size < HEADER_SIZE) {
+        throw damaged();
+    }
+    m_big_endian = gbsc_header() == "GGSC";
+    uint64_t ptr = HEADER_SIZE + uint64_t(fonts_offset());
+    m_fonts.reserve(fonts_count());
+    for (uint32_t i = 0; i < fonts_count(); i++) {
+        if (ptr + FONT_HEADER_SIZE > size) {
+            throw damaged();
+        }
+        font_view font(m_file.data() + ptr, m_big_endian);
+        if (ptr + FONT_HEADER_SIZE + uint64_t(font.chars_count()) * CHAR_SIZE > size) {
+            throw damaged();
+        }
+        m_fonts.push_back(font);
+        ptr += font.font_lenght();
     }
-    buffer.insert(buffer.end(), file_buffer.begin(), file_buffer.end());
-    export_file.write(reinterpret_cast<char*>(buffer.data()), buffer.size());
+    uint64_t tail_offset = HEADER_SIZE + uint64_t(textures_offset()) + uint64_t(textures_count()) * TEXTURE_SIZE;
+    if (tail_offset > size) {
+        throw damaged();
+    }
+    m_tail_offset = (size_t)tail_offset;
 }
 
-gbs_t merge(gbs_t& first_gbs, gbs_t& second_gbs, config config) {
-    gbs_t merged_gbs = first_gbs;
+std::string_view gbs_view::text(const unsigned char* field, size_t size) {
+    const void* end = std::memchr(field, 0, size);
+    return { reinterpret_cast<const char*>(field), end ? size_t(static_cast<const unsigned char*>(end) - field) : size };
+}
+
+glyph_transform glyph_transform::divide_coords() {
+    glyph_transform transform;
+    transform.x.scale = 1 / 1.5;
+    transform.y.scale = 1 / 1.5;
+    transform.advance.scale = 1 / 1.45;
+    return transform;
+}
+
+uint32_t glyph_transform::apply(const axis& along, uint32_t value) const {
+    transform_column(&value, 1, along, mode);
+    return value;
+}
+
+void glyph_transform::apply(std::span<gbs_t::char_t> chars) const {
+    // One array per field, grouped by axis so every axis is a single run
+    const size_t n = chars.size();
+    std::vector<uint32_t> columns(n * 6);
+    uint32_t* x_offset = columns.data();
+    uint32_t* w = x_offset + n;
+    uint32_t* y_offset = w + n;
+    uint32_t* h = y_offset + n;
+    uint32_t* top = h + n;
+    uint32_t* char_advance = top + n;
+    for (size_t i = 0; i < n; ++i) {
+        x_offset[i] = chars[i].m_char_x_offset;
+        w[i] = chars[i].m_char_w;
+        y_offset[i] = chars[i].m_char_y_offset;
+        h[i] = chars[i].m_char_h;
+        top[i] = chars[i].m_char_top;
+        char_advance[i] = chars[i].m_char_advance;
+    }
+    transform_column(x_offset, n * 2, x, mode);
+    transform_column(y_offset, n * 3, y, mode);
+    transform_column(char_advance, n, advance, mode);
+    for (size_t i = 0; i < n; ++i) {
+        chars[i].m_char_x_offset = x_offset[i];
+        chars[i].m_char_w = w[i];
+        chars[i].m_char_y_offset = y_offset[i];
+        chars[i].m_char_h = h[i];
+        chars[i].m_char_top = top[i];
+        chars[i].m_char_advance = char_advance[i];
+    }
+}
+
+void glyph_transform::apply(gbs_t::font_t& font) const {
+    apply(std::span<gbs_t::char_t>(font.m_chars));
+    font.m_max_top = apply(y, font.m_max_top);
+}
 
-    double divider = 1.5;
-    double divider2 = 1.45;
-
-    for (const auto& font : second_gbs.m_fonts) {
-        bool font_exists = false;
-
-        for (auto& existing_font : merged_gbs.m_fonts) {
-            uint32_t old_atlas_count = existing_font.m_atlas_count;
-            if (existing_font.m_font_id == font.m_font_id) {
-                font_exists = true;
-
-                for (const auto& letter : font.m_chars) {
-                    bool letter_exists = false;
-                    if (existing_font.m_max_top < (uint32_t)round(double(font.m_max_top) / divider) && has_flag(config, divide_coords)) {
-                        existing_font.m_max_top = (uint32_t)round(double(font.m_max_top) / divider);
-                    }
-                    for (const auto& existing_letter : existing_font.m_chars) {
-                        if (existing_letter.m_char_code == letter.m_char_code) {
-                            letter_exists = true;
-                            break;
-                        }
-                    }
-
-                    if (!letter_exists) {
-                        gbs_t::char_t current = letter;
-                        if (has_flag(config, divide_coords)) {
-                            current.m_char_x_offset = (uint32_t)round(double(current.m_char_x_offset) / divider);
-                            current.m_char_y_offset = (uint32_t)round(double(current.m_char_y_offset) / divider);
-                            current.m_char_w = (uint32_t)round(double(current.m_char_w) / divider);
-                            current.m_char_h = (uint32_t)round(double(current.m_char_h) / divider);
-                            current.m_char_top = (uint32_t)round(double(current.m_char_top) / divider);
-                            current.m_char_advance = (uint32_t)round(double(current.m_char_advance) / divider2);
-                        }
-                        current.m_char_atlas_index += old_atlas_count;
-
-                        existing_font.m_chars.push_back(current);
-                        if (current.m_char_atlas_index + 1 > existing_font.m_atlas_count) {
-                            existing_font.m_atlas_count = current.m_char_atlas_index + 1;
-                        }
-                        existing_font.m_chars_count++;
-                        existing_font.m_font_lenght += 0x28;
-                        
-                        merged_gbs.m_file_size += 0x28;
-                        merged_gbs.m_textures_offset += 0x28;
-                        merged_gbs.m_sounds_offset += 0x28;
-                        merged_gbs.m_view_offset += 0x28;
-                        merged_gbs.m_messages_offset += 0x28;
-                    }
+void glyph_transform::apply(gbs_t& scene) const {
+    for (auto& font : scene.m_fonts) {
+        apply(font);
+    }
+}
+
+void merge_into(gbs_t& target, const std::vector<const gbs_t*>& sources, config config, const glyph_transform& transform) {
+    // Earlier fonts and textures win, so only the first of an id is indexed
+    std::unordered_map<uint32_t, size_t> font_index;
+    font_index.reserve(target.m_fonts.size());
+    for (size_t f = 0; f < target.m_fonts.size(); ++f) {
+        font_index.try_emplace(target.m_fonts[f].m_font_id, f);
+    }
+    // Glyph codes of a font, built the first time a source adds to it
+    std::vector<std::unique_ptr<std::unordered_set<uint32_t>>> glyph_index(target.m_fonts.size());
+    std::unordered_set<uint16_t> texture_ids;
+    for (const auto& texture : target.m_textures) {
+        texture_ids.insert(texture.m_id);
+    }
+
+    for (const gbs_t* source : sources) {
+        for (const auto& font : source->m_fonts) {
+            auto found = font_index.find(font.m_font_id);
+            if (found == font_index.end()) {
+                if (has_flag(config, add_new_fonts)) {
+                    font_index.emplace(font.m_font_id, target.m_fonts.size());
+                    glyph_index.emplace_back();
+                    target.m_fonts.push_back(font);
+                    target.m_fonts_count++;
+                    // The new font sits before the textures and everything behind them
+                    uint32_t font_size = uint32_t(FONT_HEADER_SIZE + font.m_chars.size() * CHAR_SIZE);
+                    target.m_file_size += font_size;
+                    target.m_textures_offset += font_size;
+                    target.m_sounds_offset += font_size;
+                    target.m_view_offset += font_size;
+                    target.m_messages_offset += font_size;
                 }
-                break;
+                continue;
+            }
+
+            gbs_t::font_t& existing_font = target.m_fonts[found->second];
+            auto& codes = glyph_index[found->second];
+            if (!codes) {
+                codes = std::make_unique<std::unordered_set<uint32_t>>();
+                codes->reserve(existing_font.m_chars.size() + font.m_chars.size());
+                for (const auto& letter : existing_font.m_chars) {
+                    codes->insert(code_key(letter.m_char_code));
+                }
+            }
+            if (!font.m_chars.empty() && has_flag(config, divide_coords)) {
+                existing_font.m_max_top = std::max(existing_font.m_max_top, transform.apply(transform.y, font.m_max_top));
+            }
+            const uint32_t old_atlas_count = existing_font.m_atlas_count;
+            const size_t first_added = existing_font.m_chars.size();
+            existing_font.m_chars.reserve(existing_font.m_chars.size() + font.m_chars.size());
+            uint32_t added = 0;
+            for (const auto& letter : font.m_chars) {
+                if (!codes->insert(code_key(letter.m_char_code)).second) continue;
+                gbs_t::char_t current = letter;
+                current.m_char_atlas_index += old_atlas_count;
+                if (current.m_char_atlas_index + 1 > existing_font.m_atlas_count) {
+                    existing_font.m_atlas_count = current.m_char_atlas_index + 1;
+                }
+                existing_font.m_chars.push_back(std::move(current));
+                ++added;
+            }
+            if (has_flag(config, divide_coords)) {
+                transform.apply(std::span<gbs_t::char_t>(existing_font.m_chars).subspan(first_added));
             }
+            existing_font.m_chars_count += added;
+            existing_font.m_font_lenght += uint32_t(added * CHAR_SIZE);
+            target.m_file_size += uint32_t(added * CHAR_SIZE);
+            target.m_textures_offset += uint32_t(added * CHAR_SIZE);
+            target.m_sounds_offset += uint32_t(added * CHAR_SIZE);
+            target.m_view_offset += uint32_t(added * CHAR_SIZE);
+            target.m_messages_offset += uint32_t(added * CHAR_SIZE);
         }
 
-        if (!font_exists && has_flag(config, add_new_fonts)) {
-            merged_gbs.m_fonts.push_back(font);
-            merged_gbs.m_fonts_count++;
+        for (const auto& texture : source->m_textures) {
+            if (texture_ids.count(texture.m_id)) continue;
+            gbs_t::texture_t current = texture;
+            if (has_flag(config, calculate_texture_id) && !target.m_textures.empty()) {
+                current.m_id = (uint16_t)(target.m_textures.back().m_id + 1);
+                // Most records repeat their id and type behind the path
+                const uint32_t id_type = uint32_t(texture.m_id) | uint32_t(texture.m_type) << 16;
+                if (current.m_coords[0] == id_type) {
+                    current.m_coords[0] = uint32_t(current.m_id) | uint32_t(current.m_type) << 16;
+                }
+            }
+            texture_ids.insert(current.m_id);
+            target.m_textures.push_back(std::move(current));
+            target.m_textures_count++;
+
+            target.m_file_size += TEXTURE_SIZE;
+            target.m_sounds_offset += TEXTURE_SIZE;
+            target.m_view_offset += TEXTURE_SIZE;
+            target.m_messages_offset += TEXTURE_SIZE;
         }
     }
+}
 
-    for (const auto& texture : second_gbs.m_textures) {
-        bool texture_exists = false;
-        for (const auto& existing_texture : merged_gbs.m_textures) {
-            if (texture.m_id == existing_texture.m_id) {
-                texture_exists = true;
-                break;
-            }
+gbs_t merge(gbs_t base, const std::vector<const gbs_t*>& sources, config config, const glyph_transform& transform) {
+    merge_into(base, sources, config, transform);
+    return base;
+}
+
+gbs_t merge(gbs_t& first_gbs, gbs_t& second_gbs, config config) {
+    gbs_t merged_gbs = first_gbs;
+    merge_into(merged_gbs, { &second_gbs }, config);
+    return merged_gbs;
+}
+
+config parse_config(std::string_view names) {
+    config result = config::None;
+    while (!names.empty()) {
+        size_t comma = names.find(',');
+        std::string_view name = names.substr(0, comma);
+        names = comma == std::string_view::npos ? std::string_view() : names.substr(comma + 1);
+        if (name == "add_new_fonts") result = result | add_new_fonts;
+        else if (name == "divide_coords") result = result | divide_coords;
+        else if (name == "calculate_texture_id") result = result | calculate_texture_id;
+        else if (name == "all") result = result | All;
+        else if (name != "none" && !name.empty()) {
+            throw std::invalid_argument("Unknown merge option: " + std::string(name));
         }
-        if (!texture_exists) {
-            gbs_t::texture_t current = texture;
-            if (has_flag(config, calculate_texture_id)) {
-                current.m_id = (uint16_t)(merged_gbs.m_textures.back().m_id + 1);
+    }
+    return result;
+}
+
+merge_summary merge_files(const fs::path& base_path, const std::vector<fs::path>& source_paths, const fs::path& output_path,
+    config config, const glyph_transform& transform) {
+    gbs_t target(base_path);
+    std::vector<gbs_t> sources;
+    sources.reserve(source_paths.size());
+    std::vector<const gbs_t*> source_ptrs;
+    for (const auto& path : source_paths) {
+        sources.emplace_back(path);
+        source_ptrs.push_back(&sources.back());
+    }
+    auto glyph_count = [&] {
+        size_t count = 0;
+        for (const auto& font : target.fonts()) count += font.chars().size();
+        return count;
+    };
+    const size_t fonts = target.fonts().size();
+    const size_t glyphs = glyph_count();
+    const size_t textures = target.textures().size();
+    merge_into(target, source_ptrs, config, transform);
+
+    merge_summary summary;
+    summary.fonts_added = uint32_t(target.fonts().size() - fonts);
+    summary.glyphs_added = uint32_t(glyph_count() - glyphs);
+    summary.textures_added = uint32_t(target.textures().size() - textures);
+    if (output_path.has_parent_path()) {
+        fs::create_directories(output_path.parent_path());
+    }
+    target.write(output_path);
+    return summary;
+}
+
+scene_pairs pair_scenes(const fs::path& base_dir, const fs::path& source_dir) {
+    auto list = [](const fs::path& dir) {
+        std::vector<std::string> scenes;
+        for (const auto& entry : fs::recursive_directory_iterator(dir)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".gbs") {
+                scenes.push_back(fs::relative(entry.path(), dir).generic_string());
             }
-            merged_gbs.m_textures.push_back(current);
-            merged_gbs.m_textures_count++;
+        }
+        std::sort(scenes.begin(), scenes.end());
+        return scenes;
+    };
+    std::vector<std::string> base = list(base_dir);
+    std::vector<std::string> source = list(source_dir);
 
-            merged_gbs.m_file_size += 0x11C;
-            merged_gbs.m_sounds_offset += 0x11C;
-            merged_gbs.m_view_offset += 0x11C;
-            merged_gbs.m_messages_offset += 0x11C;
+    // Both lists are sorted, so one walk over them sorts every scene into its list
+    scene_pairs pairs;
+    size_t b = 0, s = 0;
+    while (b < base.size() || s < source.size()) {
+        if (s == source.size() || (b < base.size() && base[b] < source[s])) {
+            pairs.base_only.push_back(std::move(base[b++]));
+        }
+        else if (b == base.size() || source[s] < base[b]) {
+            pairs.source_only.push_back(std::move(source[s++]));
+        }
+        else {
+            pairs.matched.push_back(std::move(base[b++]));
+            ++s;
         }
     }
-    
-    return merged_gbs;
+    return pairs;
 }
 
 } 
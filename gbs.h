@@ -5,10 +5,26 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <string_view>
+#include <span>
+#include <iterator>
+#include <cstddef>
+#include <array>
 #include "reader_writer.h"
+#include "byte_order.h"
+#include "file_io.h"
 
 namespace fs = std::filesystem;
 namespace gbs {
+    // Record sizes of a scene file. The offsets in the header count from the
+    // end of the header. Every number and four-byte tag is stored in the byte
+    // order of the platform, big-endian on PS3 ("GGSC" magic) and
+    // little-endian elsewhere ("CSGG").
+    const size_t HEADER_SIZE = 56;
+    const size_t FONT_HEADER_SIZE = 100;
+    const size_t CHAR_SIZE = 0x28;
+    const size_t TEXTURE_SIZE = 0x11C;
+
     enum config : uint32_t {
         None = 0,
         add_new_fonts = 1 << 0,
@@ -28,6 +44,12 @@ namespace gbs {
             static_cast<uint32_t>(flag)) != 0;
     }
 
+    struct glyph_transform;
+
+    // A scene read into memory. Numbers are decoded whatever the platform, and
+    // four-byte tags (the magic, font labels, glyph codes and the version) are
+    // kept in little-endian order, so scenes of both platforms compare and
+    // merge alike. write() stores everything in the byte order of the scene.
 class gbs_t {
     public:
         class font_t;
@@ -37,12 +59,13 @@ class gbs_t {
         void write(fs::path const pathtowrite);
     private:
         void _read();
+        size_t _serialized_size() const;
     public:
         class font_t {
         public:
-            font_t(std::vector<unsigned char>& buffer, size_t ptr);
+            font_t(const std::vector<unsigned char>& buffer, size_t ptr, bool big_endian);
         private:
-            void _read(std::vector<unsigned char>& buffer, size_t ptr);
+            void _read(const std::vector<unsigned char>& buffer, size_t ptr, bool big_endian);
         private:
             std::string m_gfnt_lable;
             uint32_t m_font_lenght;
@@ -55,28 +78,29 @@ class gbs_t {
             uint32_t m_atlas_count;
             uint32_t m_chars_count;
             std::vector<char_t> m_chars;
-            friend gbs_t merge(gbs_t& first_gbs, gbs_t& second_gbs, config config);
+            friend void merge_into(gbs_t& target, const std::vector<const gbs_t*>& sources, config config, const glyph_transform& transform);
+            friend struct glyph_transform;
         public:
-            std::string gfnt_lable() const { return m_gfnt_lable; }
+            const std::string& gfnt_lable() const { return m_gfnt_lable; }
             uint32_t font_lenght() const { return m_font_lenght; }
             uint32_t font_id() const { return m_font_id; }
-            std::string font_name() const { return m_font_name; }
+            const std::string& font_name() const { return m_font_name; }
             uint32_t font_size() const { return m_font_size; }
             uint32_t atlas_w() const { return m_atlas_w; }
             uint32_t atlas_h() const { return m_atlas_h; }
             uint32_t max_top() const { return m_max_top; }
             uint32_t atlas_count() const { return m_atlas_count; }
             uint32_t chars_count() const { return m_chars_count; }
-            std::vector<char_t> chars() const { return m_chars; }
+            const std::vector<char_t>& chars() const { return m_chars; }
         public:
             size_t size() const { return m_font_lenght; }
         };
         class char_t {
         public:
-            char_t(std::vector <unsigned char>& file_buffer, size_t ptr_f);
+            char_t(const std::vector<unsigned char>& file_buffer, size_t ptr_f, bool big_endian);
             ~char_t() = default;
         private:
-            void _read(std::vector <unsigned char>& file_buffer, size_t ptr_f);
+            void _read(const std::vector<unsigned char>& file_buffer, size_t ptr_f, bool big_endian);
         private:
             std::string m_char_code;
             uint32_t m_is_image_glyph;
@@ -88,9 +112,10 @@ class gbs_t {
             uint32_t m_char_advance;
             uint32_t m_char_left_bearning;
             uint32_t m_char_atlas_index;
-            friend gbs_t merge(gbs_t& first_gbs, gbs_t& second_gbs, config config);
+            friend void merge_into(gbs_t& target, const std::vector<const gbs_t*>& sources, config config, const glyph_transform& transform);
+            friend struct glyph_transform;
         public:
-            std::string char_code() const { return m_char_code; }
+            const std::string& char_code() const { return m_char_code; }
             uint32_t is_image_glyph() const { return m_is_image_glyph; }
             uint32_t char_x_offset() const { return m_char_x_offset; }
             uint32_t char_y_offset() const { return m_char_y_offset; }
@@ -103,23 +128,28 @@ class gbs_t {
         };
         class texture_t {
         public:
-            texture_t(std::vector<unsigned char>& buffer, size_t ptr);
+            texture_t(const std::vector<unsigned char>& buffer, size_t ptr, bool big_endian);
         private:
-            void _read(std::vector<unsigned char>& buffer, size_t ptr);
+            void _read(const std::vector<unsigned char>& buffer, size_t ptr, bool big_endian);
         private:
             uint16_t m_id;
             uint16_t m_type;
             std::string m_path;
-            friend gbs_t merge(gbs_t& first_gbs, gbs_t& second_gbs, config config);
+            // The 20 bytes behind the path: the id and type again (or zero) and
+            // the texture coordinates, kept as read
+            std::array<uint32_t, 5> m_coords;
+            friend void merge_into(gbs_t& target, const std::vector<const gbs_t*>& sources, config config, const glyph_transform& transform);
         public:
             uint16_t id() const { return m_id; }
             uint16_t type() const { return m_type; }
-            std::string path() const { return m_path; }
+            const std::string& path() const { return m_path; }
+            const std::array<uint32_t, 5>& coords() const { return m_coords; }
         public:
             size_t size() const { return 0x11C; }
         };
     private:
         std::string m_gbsc_header = "CSGG";
+        bool m_big_endian{ false };
         uint32_t m_file_size;
         std::string m_data_version;
         uint32_t m_scene_id;
@@ -135,11 +165,14 @@ class gbs_t {
         uint32_t m_messages_offset;
         std::vector<font_t> m_fonts;
         std::vector<texture_t> m_textures;
-        friend gbs_t merge(gbs_t& first_gbs, gbs_t& second_gbs, config config);
+        size_t m_tail_offset{ 0 }; // sounds, views and messages are kept as read, from here on
+        friend void merge_into(gbs_t& target, const std::vector<const gbs_t*>& sources, config config, const glyph_transform& transform);
+        friend struct glyph_transform;
     public:
-        std::string gbsc_header() const { return m_gbsc_header; }
+        const std::string& gbsc_header() const { return m_gbsc_header; }
+        bool big_endian() const { return m_big_endian; }
         uint32_t file_size() const { return m_file_size; }
-        std::string data_version() const { return m_data_version; }
+        const std::string& data_version() const { return m_data_version; }
         uint32_t scene_id() const { return m_scene_id; }
         uint32_t fonts_count() const { return m_fonts_count; }
         uint32_t textures_count() const { return m_textures_count; }
@@ -151,13 +184,213 @@ class gbs_t {
         uint32_t sounds_offset() const { return m_sounds_offset; }
         uint32_t view_offset() const { return m_view_offset; }
         uint32_t messages_offset() const { return m_messages_offset; }
-        std::vector<font_t> fonts() const { return m_fonts; }
-        std::vector<texture_t> textures() const { return m_textures; }
+        const std::vector<font_t>& fonts() const { return m_fonts; }
+        const std::vector<texture_t>& textures() const { return m_textures; }
     private:
         std::vector<unsigned char> file_buffer;
     public:
         //  std::vector<unsigned char> file_buffer() const { return file_buffer; }
     };
+    // Rescales glyph metrics: a field becomes value * scale + offset of its
+    // axis, rounded by `mode` and clamped to the uint32_t range. x covers
+    // char_x_offset and char_w, y covers char_y_offset, char_h, char_top and
+    // a font's max_top, advance covers char_advance. Glyph tables are split
+    // into one array per field and every array is converted in one pass, two
+    // values per instruction with SSE4.1 when the CPU has it.
+    struct glyph_transform {
+        enum class rounding : uint32_t {
+            nearest, // halves away from zero, as std::round
+            down,
+            up,
+        };
+        struct axis {
+            double scale{ 1.0 };
+            double offset{ 0.0 };
+        };
+        axis x;
+        axis y;
+        axis advance;
+        rounding mode{ rounding::nearest };
+
+        // What merge applies with divide_coords: 1 / 1.5, and 1 / 1.45 for the advance
+        static glyph_transform divide_coords();
+
+        uint32_t apply(const axis& along, uint32_t value) const;
+        void apply(std::span<gbs_t::char_t> chars) const;
+        // Every glyph of the font and its max_top
+        void apply(gbs_t::font_t& font) const;
+        void apply(gbs_t& scene) const;
+    };
+
+    // Merges the sources into target, in order. Fonts are matched by id,
+    // glyphs by their code and textures by id through hash indexes, so every
+    // source record costs one lookup. Whatever is already in target wins: a
+    // record from a source is only added when target and the sources before it
+    // had nothing under its key. With divide_coords, glyphs merged into an
+    // existing font are rescaled by `transform`.
+    void merge_into(gbs_t& target, const std::vector<const gbs_t*>& sources, config config = config::None,
+        const glyph_transform& transform = glyph_transform::divide_coords());
+    // Same, taking the base by value: pass it with std::move to merge without copying it
+    gbs_t merge(gbs_t base, const std::vector<const gbs_t*>& sources, config config = config::None,
+        const glyph_transform& transform = glyph_transform::divide_coords());
     gbs_t merge(gbs_t& first_gbs, gbs_t& second_gbs, config config = config::None);
+
+    // "add_new_fonts,divide_coords", "all" or "none"; throws std::invalid_argument on an unknown name
+    config parse_config(std::string_view names);
+
+    // What merge_files added to the base scene
+    struct merge_summary {
+        uint32_t fonts_added{ 0 };
+        uint32_t glyphs_added{ 0 };
+        uint32_t textures_added{ 0 };
+    };
+    // Reads the base and the sources, merges them and writes the result to
+    // output_path (which may be base_path), creating its folder if needed.
+    // The result keeps the byte order of the base.
+    merge_summary merge_files(const fs::path& base_path, const std::vector<fs::path>& source_paths, const fs::path& output_path,
+        config config = config::None, const glyph_transform& transform = glyph_transform::divide_coords());
+
+    // The .gbs files of two folder trees, matched by their path below the
+    // folder. Every list is sorted and holds generic relative paths.
+    struct scene_pairs {
+        std::vector<std::string> matched;
+        std::vector<std::string> base_only;
+        std::vector<std::string> source_only;
+    };
+    scene_pairs pair_scenes(const fs::path& base_dir, const fs::path& source_dir);
+
+    // Read-only view of a scene file. The file is mapped once and fonts,
+    // glyphs and textures are handed out as small handles onto their records
+    // that decode fields on access, nothing is copied out of the mapping.
+    // Record bounds are checked once when the view is opened. Names and paths
+    // come without their zero padding, tags as stored.
+    class gbs_view {
+    public:
+        // Fixed size records stored back to back
+        template<typename View, size_t Stride>
+        class record_range {
+        public:
+            class iterator {
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = View;
+                using difference_type = std::ptrdiff_t;
+                using pointer = void;
+                using reference = View;
+                iterator() = default;
+                iterator(const unsigned char* record, bool big_endian) : m_record(record), m_big_endian(big_endian) {}
+                View operator*() const { return View(m_record, m_big_endian); }
+                iterator& operator++() { m_record += Stride; return *this; }
+                iterator operator++(int) { iterator old = *this; m_record += Stride; return old; }
+                bool operator==(const iterator& other) const { return m_record == other.m_record; }
+            private:
+                const unsigned char* m_record{ nullptr };
+                bool m_big_endian{ false };
+            };
+            record_range() = default;
+            record_range(const unsigned char* first, size_t count, bool big_endian) : m_first(first), m_count(count), m_big_endian(big_endian) {}
+            size_t size() const { return m_count; }
+            bool empty() const { return m_count == 0; }
+            View operator[](size_t i) const { return View(m_first + i * Stride, m_big_endian); }
+            iterator begin() const { return iterator(m_first, m_big_endian); }
+            iterator end() const { return iterator(m_first + m_count * Stride, m_big_endian); }
+        private:
+            const unsigned char* m_first{ nullptr };
+            size_t m_count{ 0 };
+            bool m_big_endian{ false };
+        };
+
+        // Base of the handles: one record and the byte order of its file
+        class record_view {
+        public:
+            record_view(const unsigned char* record, bool big_endian) : m_record(record), m_big_endian(big_endian) {}
+            const unsigned char* data() const { return m_record; }
+        protected:
+            uint32_t _u32(size_t offset) const {
+                return m_big_endian ? byte_order::load_be<uint32_t>(m_record + offset) : byte_order::load_le<uint32_t>(m_record + offset);
+            }
+            std::string_view _tag(size_t offset) const { return { reinterpret_cast<const char*>(m_record + offset), 4 }; }
+        protected:
+            const unsigned char* m_record;
+            bool m_big_endian;
+        };
+
+        class glyph_view : public record_view {
+        public:
+            using record_view::record_view;
+            // All four bytes as stored, code() is the same as a number
+            std::string_view char_code() const { return _tag(0); }
+            uint32_t code() const { return _u32(0); }
+            uint32_t is_image_glyph() const { return _u32(4); }
+            uint32_t char_x_offset() const { return _u32(8); }
+            uint32_t char_y_offset() const { return _u32(12); }
+            uint32_t char_w() const { return _u32(16); }
+            uint32_t char_h() const { return _u32(20); }
+            uint32_t char_top() const { return _u32(24); }
+            uint32_t char_advance() const { return _u32(28); }
+            uint32_t char_left_bearning() const { return _u32(32); }
+            uint32_t char_atlas_index() const { return _u32(36); }
+        };
+
+        class font_view : public record_view {
+        public:
+            using record_view::record_view;
+            std::string_view gfnt_lable() const { return _tag(0); }
+            uint32_t font_lenght() const { return _u32(4); }
+            uint32_t font_id() const { return _u32(8); }
+            std::string_view font_name() const { return text(m_record + 12, 64); }
+            uint32_t font_size() const { return _u32(76); }
+            uint32_t atlas_w() const { return _u32(80); }
+            uint32_t atlas_h() const { return _u32(84); }
+            uint32_t max_top() const { return _u32(88); }
+            uint32_t atlas_count() const { return _u32(92); }
+            uint32_t chars_count() const { return _u32(96); }
+            record_range<glyph_view, CHAR_SIZE> chars() const { return { m_record + FONT_HEADER_SIZE, chars_count(), m_big_endian }; }
+        };
+
+        class texture_view : public record_view {
+        public:
+            using record_view::record_view;
+            // The id is the low half of the first number, the type the high one
+            uint16_t id() const { return uint16_t(_u32(0)); }
+            uint16_t type() const { return uint16_t(_u32(0) >> 16); }
+            std::string_view path() const { return text(m_record + 4, 260); }
+        };
+
+        explicit gbs_view(const fs::path& path);
+
+        std::string_view gbsc_header() const { return { reinterpret_cast<const char*>(m_file.data()), 4 }; }
+        bool big_endian() const { return m_big_endian; }
+        uint32_t file_size() const { return _u32(4); }
+        std::string_view data_version() const { return { reinterpret_cast<const char*>(m_file.data() + 8), 4 }; }
+        uint32_t scene_id() const { return _u32(12); }
+        uint32_t fonts_count() const { return _u32(16); }
+        uint32_t textures_count() const { return _u32(20); }
+        uint32_t sounds_count() const { return _u32(24); }
+        uint32_t views_count() const { return _u32(28); }
+        uint32_t messages_count() const { return _u32(32); }
+        uint32_t fonts_offset() const { return _u32(36); }
+        uint32_t textures_offset() const { return _u32(40); }
+        uint32_t sounds_offset() const { return _u32(44); }
+        uint32_t view_offset() const { return _u32(48); }
+        uint32_t messages_offset() const { return _u32(52); }
+        // Fonts are of different lengths, so where each starts is found once on open
+        const std::vector<font_view>& fonts() const { return m_fonts; }
+        record_range<texture_view, TEXTURE_SIZE> textures() const { return { m_file.data() + HEADER_SIZE + textures_offset(), textures_count(), m_big_endian }; }
+        // Everything behind the textures table (sounds, views and messages)
+        std::span<const unsigned char> tail() const { return m_file.bytes(m_tail_offset, m_file.size() - m_tail_offset); }
+        const file_io::mapped_file& file() const { return m_file; }
+    private:
+        // Zero padded text field
+        static std::string_view text(const unsigned char* field, size_t size);
+        uint32_t _u32(size_t offset) const {
+            return m_big_endian ? byte_order::load_be<uint32_t>(m_file.data() + offset) : byte_order::load_le<uint32_t>(m_file.data() + offset);
+        }
+    private:
+        file_io::mapped_file m_file;
+        bool m_big_endian{ false };
+        std::vector<font_view> m_fonts;
+        size_t m_tail_offset{ 0 };
+    };
 }
 
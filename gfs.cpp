@@ -6,6 +6,11 @@
 #include <algorithm>
 #include <io.h>
 #include <cstring>
+#include <sstream>
+#include <optional>
+#include <atomic>
+#include "checksum.h"
+#include "trace.h"
 
 namespace fs = std::filesystem;
 
@@ -14,37 +19,141 @@ const size_t HEADER_SIZE = 0x33;
 const size_t HEADER_COUNT_FILES_OFFSET = 0x2B;
 const std::string FILE_IDENTIFIER = "Reverge Package File";
 const std::string FILE_VERSION = "1.1";
-#ifdef _32bit
-const size_t MAX_BUFFER_SIZE = 1024 * 1024 * 4; //16MB
-#else
-const size_t MAX_BUFFER_SIZE = 1024 * 1024 * 16; //64MB
-#endif
-
-uint32_t readBufferChar_to_UnInt32(const unsigned char* buffer, size_t Start = 0) {
-    return
-        (uint32_t)buffer[Start + 3] |
-        ((uint32_t)buffer[Start + 2] << 8) |
-        ((uint32_t)buffer[Start + 1] << 16) |
-        ((uint32_t)buffer[Start] << 24);
-}
-
-uint64_t readBufferChar_to_UnInt64(const unsigned char* buffer, size_t Start = 0) {
-    return
-        (uint64_t)buffer[Start + 7] |
-        ((uint64_t)buffer[Start + 6] << 8) |
-        ((uint64_t)buffer[Start + 5] << 16) |
-        ((uint64_t)buffer[Start + 4] << 24) |
-        ((uint64_t)buffer[Start + 3] << 32) |
-        ((uint64_t)buffer[Start + 2] << 40) |
-        ((uint64_t)buffer[Start + 1] << 48) |
-        ((uint64_t)buffer[Start] << 56);
+
+// Entries start at the next multiple of their alignment field, counted from the start of the archive
+uint64_t align_up(uint64_t offset, uint32_t alignment) {
+    return alignment > 1 ? (offset + alignment - 1) / alignment * alignment : offset;
 }
+
 template<typename T>
 void append_byteswapped(std::vector<unsigned char>& buffer, T value) {
-    T swapped = compat::byteswap(value);
     size_t old_size = buffer.size();
     buffer.resize(old_size + sizeof(T));
-    std::memcpy(buffer.data() + old_size, &swapped, sizeof(T));
+    byte_order::store_be(buffer.data() + old_size, value);
+}
+
+// Manifest written next to an archive packed incrementally: one line per
+// entry with the source file's size, write time and (if known) CRC-32C.
+// The first line records the archive's size and write time so a manifest
+// left behind by an older archive is never trusted.
+const std::string MANIFEST_MAGIC = "GFS-MANIFEST 1";
+
+struct ManifestEntry {
+    uint64_t size;
+    int64_t mtime;
+    bool has_crc;
+    uint32_t crc;
+};
+
+fs::path manifest_path(const fs::path& archive_path) {
+    fs::path path = archive_path;
+    return path += ".manifest";
+}
+
+int64_t write_time(const fs::path& path) {
+    return (int64_t)fs::last_write_time(path).time_since_epoch().count();
+}
+
+std::unordered_map<std::string, ManifestEntry> read_manifest(const fs::path& archive_path) {
+    std::unordered_map<std::string, ManifestEntry> entries;
+    std::error_code ec;
+    if (!fs::exists(archive_path, ec) || !fs::exists(manifest_path(archive_path), ec)) {
+        return entries;
+    }
+    std::ifstream manifest(manifest_path(archive_path), std::ios::binary);
+    std::string line;
+    if (!std::getline(manifest, line)) {
+        return entries;
+    }
+    std::istringstream header(line);
+    std::string magic, version;
+    uint64_t archive_size{ 0 };
+    int64_t archive_mtime{ 0 };
+    header >> magic >> version >> archive_size >> archive_mtime;
+    if (header.fail() || magic + " " + version != MANIFEST_MAGIC ||
+        archive_size != fs::file_size(archive_path) || archive_mtime != write_time(archive_path)) {
+        return entries;
+    }
+    while (std::getline(manifest, line)) {
+        std::istringstream fields(line);
+        ManifestEntry entry{};
+        std::string crc;
+        fields >> entry.size >> entry.mtime >> crc;
+        if (fields.fail() || fields.get() != ' ') {
+            entries.clear(); // damaged manifest, pack everything again
+            return entries;
+        }
+        entry.has_crc = crc != "-";
+        entry.crc = entry.has_crc ? (uint32_t)std::stoul(crc, nullptr, 16) : 0;
+        std::string relative_path;
+        std::getline(fields, relative_path);
+        entries[relative_path] = entry;
+    }
+    return entries;
+}
+
+GFSView::GFSView(const fs::path path) : m_file(path) {
+    _read();
+}
+
+GFSView::GFSView(HANDLE file) : m_file(file) {
+    _read();
+}
+
+void GFSView::_read() {
+    m_entries = parse({ m_file.data(), (size_t)m_file.size() }, m_file.size(), m_data_offset);
+}
+
+std::vector<GFSView::Entry> GFSView::parse(std::span<const unsigned char> archive, uint64_t archive_size, uint32_t& data_offset_out) {
+    if (archive.size() < HEADER_SIZE) {
+        throw std::runtime_error("File is too small for a GFS header");
+    }
+    const unsigned char* begin = archive.data();
+    const unsigned char* end = begin + archive.size();
+    uint32_t table_end = byte_order::load_be<uint32_t>(begin);
+    uint64_t count_of_files = byte_order::load_be<uint64_t>(begin + HEADER_COUNT_FILES_OFFSET);
+    if (table_end > archive_size) {
+        throw std::runtime_error("Data offset is out of range");
+    }
+
+    std::vector<Entry> entries;
+    // Every record takes at least 20 bytes, don't trust the count beyond that
+    entries.reserve((size_t)std::min<uint64_t>(count_of_files, table_end / 20));
+    const unsigned char* ptr = begin + HEADER_SIZE;
+    uint64_t data_offset = table_end;
+    for (uint64_t i = 0; i < count_of_files; ++i) {
+        if (end - ptr < 8) {
+            throw std::runtime_error("Metadata is truncated");
+        }
+        uint64_t path_len = byte_order::load_be<uint64_t>(ptr);
+        ptr += sizeof(uint64_t);
+        if ((uint64_t)(end - ptr) < path_len + sizeof(uint64_t) + sizeof(uint32_t)) {
+            throw std::runtime_error("Metadata is truncated");
+        }
+        std::string_view relative_path(reinterpret_cast<const char*>(ptr), (size_t)path_len);
+        ptr += path_len;
+        uint64_t file_len = byte_order::load_be<uint64_t>(ptr);
+        ptr += sizeof(uint64_t);
+        uint32_t alignment = byte_order::load_be<uint32_t>(ptr);
+        ptr += sizeof(uint32_t);
+
+        data_offset = align_up(data_offset, alignment);
+        if (data_offset > archive_size || file_len > archive_size - data_offset) {
+            throw std::runtime_error("File data is out of range: " + std::string(relative_path));
+        }
+        entries.push_back({ relative_path, file_len, data_offset, alignment });
+        data_offset += file_len;
+    }
+    data_offset_out = table_end;
+    return entries;
+}
+
+std::span<const unsigned char> GFSView::data(const Entry& entry) const {
+    return m_file.bytes(entry.data_offset, entry.data_length);
+}
+
+void GFSView::extract(const Entry& entry, const fs::path& output_path) const {
+    file_io::write_file(output_path, data(entry));
 }
 
 GFSEdit::GFSEdit(const fs::path path) : gfs_path(path) {
@@ -63,41 +172,66 @@ GFSEdit::GFSEdit(const fs::path path) : gfs_path(path) {
     }
 
     std::vector<unsigned char> meta_buffer(HEADER_SIZE);
-    if (!ReadFile(hFile, meta_buffer.data(), (DWORD)(DWORD)meta_buffer.capacity(), NULL, NULL)) {
+    DWORD read = 0;
+    if (!ReadFile(hFile, meta_buffer.data(), (DWORD)meta_buffer.size(), &read, NULL) || read != meta_buffer.size()) {
         throw std::runtime_error("Failed to read header: " + gfs_path.string());
     }
-    unsigned char* ptr = meta_buffer.data();
-    header.data_offset = readBufferChar_to_UnInt32(ptr);
-    header.count_of_files = readBufferChar_to_UnInt64(ptr, HEADER_COUNT_FILES_OFFSET);
-
-    meta_buffer.resize(header.data_offset);
-    if (!ReadFile(hFile, meta_buffer.data(), (DWORD)meta_buffer.capacity(), NULL, NULL)) {
-        throw std::runtime_error("Failed to read Meta Data: " + gfs_path.string());
+    LARGE_INTEGER archive_size;
+    if (!GetFileSizeEx(hFile, &archive_size)) {
+        throw std::runtime_error("Failed to get size of: " + gfs_path.string());
     }
-    ptr = meta_buffer.data();
-    uint64_t data_offset = 0;
-    for (size_t i = 0; i < header.count_of_files; ++i) {
-        uint64_t path_len = readBufferChar_to_UnInt64(ptr);
+    // The table runs up to the data offset, every record is checked against it
+    // and every entry's data against the file size, as in GFSView::parse
+    header.data_offset = byte_order::load_be<uint32_t>(meta_buffer.data());
+    header.count_of_files = byte_order::load_be<uint64_t>(meta_buffer.data() + HEADER_COUNT_FILES_OFFSET);
+    const uint64_t file_size = (uint64_t)archive_size.QuadPart;
+    if (header.data_offset < HEADER_SIZE || header.data_offset > file_size) {
+        throw std::runtime_error("Data offset is out of range: " + gfs_path.string());
+    }
+    if (header.data_offset > HEADER_SIZE) {
+        meta_buffer.resize(header.data_offset);
+        DWORD table_size = DWORD(header.data_offset - HEADER_SIZE);
+        if (!ReadFile(hFile, meta_buffer.data() + HEADER_SIZE, table_size, &read, NULL) || read != table_size) {
+            throw std::runtime_error("Failed to read Meta Data: " + gfs_path.string());
+        }
+    }
+    const unsigned char* ptr = meta_buffer.data() + HEADER_SIZE;
+    const unsigned char* end = meta_buffer.data() + meta_buffer.size();
+    // Every record is 20 bytes plus its path, which bounds the arena
+    size_t record_count = (size_t)std::min<uint64_t>(header.count_of_files, (end - ptr) / 20);
+    files_meta_data.reserve(record_count, (end - ptr) - record_count * 20);
+    uint64_t data_offset = header.data_offset;
+    for (uint64_t i = 0; i < header.count_of_files; ++i) {
+        if (end - ptr < 8) {
+            throw std::runtime_error("Metadata is truncated: " + gfs_path.string());
+        }
+        uint64_t path_len = byte_order::load_be<uint64_t>(ptr);
         ptr += sizeof(uint64_t);
-
-
-        std::string relative_path(ptr, ptr + path_len);
+        if ((uint64_t)(end - ptr) < path_len + sizeof(uint64_t) + sizeof(uint32_t)) {
+            throw std::runtime_error("Metadata is truncated: " + gfs_path.string());
+        }
+        std::string_view relative_path((const char*)ptr, (size_t)path_len);
         ptr += path_len;
-
-
-        uint64_t file_len = readBufferChar_to_UnInt64(ptr);
+        uint64_t file_len = byte_order::load_be<uint64_t>(ptr);
         ptr += sizeof(uint64_t);
-
-
+        uint32_t file_alignment = byte_order::load_be<uint32_t>(ptr);
         ptr += sizeof(uint32_t);
-        files_meta_data.emplace_back(FileMetaData{
-             relative_path,
-             file_len,
-             data_offset
-            });
 
+        data_offset = align_up(data_offset, file_alignment);
+        if (data_offset > file_size || file_len > file_size - data_offset) {
+            throw std::runtime_error("File data is out of range: " + std::string(relative_path));
+        }
+        files_meta_data.push_back(relative_path, file_len, data_offset - header.data_offset, file_alignment);
         data_offset += file_len;
     }
+    header.metadata_end = ptr - meta_buffer.data();
+    // Added entries follow the layout the archive was packed with
+    if (!files_meta_data.empty()) {
+        alignment = std::max(files_meta_data.alignment.back(), 1u);
+    }
+    // Whatever the packer left between the table and the data is kept on rewrites
+    metadata_reserve = header.data_offset > header.metadata_end ? uint32_t(header.data_offset - header.metadata_end) : 0;
+    _build_index();
 }
 
 GFSEdit::~GFSEdit() {
@@ -110,9 +244,35 @@ void GFSEdit::print_header() {
 }
 
 void GFSEdit::print_file_metadata(size_t idx) {
-    std::cout << "relative_path: " << files_meta_data[idx].relative_path << '\n';
-    std::cout << "data_length: " << files_meta_data[idx].data_length << '\n';
-    std::cout << "data_offset: " << files_meta_data[idx].data_offset << '\n';
+    std::cout << "relative_path: " << files_meta_data.path(idx) << '\n';
+    std::cout << "data_length: " << files_meta_data.data_length[idx] << '\n';
+    std::cout << "data_offset: " << files_meta_data.data_offset[idx] << '\n';
+}
+
+void GFSEdit::_build_index() {
+    meta_index.clear();
+    meta_index.reserve(files_meta_data.size());
+    has_duplicate_paths = false;
+    for (size_t i = 0; i < files_meta_data.size(); ++i) {
+        // Like a front to back search, the first entry of a duplicated path wins
+        if (!meta_index.emplace(files_meta_data.path(i), i).second) {
+            has_duplicate_paths = true;
+        }
+    }
+
+    sorted_meta.resize(files_meta_data.size());
+    for (size_t i = 0; i < sorted_meta.size(); ++i) {
+        sorted_meta[i] = i;
+    }
+    std::sort(sorted_meta.begin(), sorted_meta.end(), [&](size_t a, size_t b) {
+        int cmp = files_meta_data.path(a).compare(files_meta_data.path(b));
+        return cmp < 0 || (cmp == 0 && a < b);
+    });
+
+    pending_index.clear();
+    for (size_t i = 0; i < pending_changes.size(); ++i) {
+        pending_index.emplace(pending_changes[i].relative_path, i);
+    }
 }
 
 void GFSEdit::add_file(const fs::path& file_path, const std::string& relative_path_in_archive, bool replace_existing) {
@@ -122,33 +282,79 @@ void GFSEdit::add_file(const fs::path& file_path, const std::string& relative_pa
     if (!fs::is_regular_file(file_path)) {
         throw std::runtime_error("Path is not a regular file: " + file_path.string());
     }
+    _add_change({ relative_path_in_archive, file_path, false, 0 }, replace_existing);
+}
 
-    auto pending_it = std::find_if(
-        pending_changes.begin(),
-        pending_changes.end(),
-        [&](const PendingChange& pc)
-        { return pc.relative_path == relative_path_in_archive; });
+void GFSEdit::add_file_range(const fs::path& source_path, uint64_t offset, uint64_t length,
+    const std::string& relative_path_in_archive, uint32_t file_alignment, bool replace_existing) {
+    if (!fs::is_regular_file(source_path)) {
+        throw std::runtime_error("Path is not a regular file: " + source_path.string());
+    }
+    if (offset > fs::file_size(source_path) || length > fs::file_size(source_path) - offset) {
+        throw std::runtime_error("Range is out of the source file: " + source_path.string());
+    }
+    _add_change({ relative_path_in_archive, source_path, false, file_alignment, offset, length }, replace_existing);
+}
 
-    if (pending_it != pending_changes.end()) {
-        pending_it->source_path = file_path;
+// change.alignment 0 picks the replaced entry's alignment, or the archive's for new ones
+void GFSEdit::_add_change(PendingChange change, bool replace_existing) {
+    auto pending_it = pending_index.find(change.relative_path);
+    if (pending_it != pending_index.end()) {
+        PendingChange& pending = pending_changes[pending_it->second];
+        pending.source_path = change.source_path;
+        pending.source_offset = change.source_offset;
+        pending.source_length = change.source_length;
+        if (change.alignment != 0) pending.alignment = change.alignment;
         return;
     }
 
-    auto meta_it = std::find_if(
-        files_meta_data.begin(),
-        files_meta_data.end(),
-        [&](const FileMetaData& meta)
-        { return meta.relative_path == relative_path_in_archive; });
+    // Adding a path back after remove_file replaces it like before
+    bool was_removed = pending_removals.erase(change.relative_path) != 0;
+    auto meta_it = meta_index.find(change.relative_path);
+    bool exists = meta_it != meta_index.end();
+    if (exists && !replace_existing && !was_removed) {
+        throw std::runtime_error("File already exists in archive: " + change.relative_path);
+    }
 
-    if (meta_it != files_meta_data.end() && !replace_existing) {
-        throw std::runtime_error("File already exists in archive: " + relative_path_in_archive);
+    change.is_new = !exists;
+    if (change.alignment == 0) {
+        change.alignment = exists ? files_meta_data.alignment[meta_it->second] : alignment;
+    }
+    pending_index.emplace(change.relative_path, pending_changes.size());
+    pending_changes.push_back(std::move(change));
+}
+
+void GFSEdit::remove_file(const std::string& relative_path_in_archive) {
+    bool exists = meta_index.count(relative_path_in_archive) != 0;
+    auto pending_it = pending_index.find(relative_path_in_archive);
+    if (!exists && pending_it == pending_index.end()) {
+        throw std::runtime_error("File not found in archive: " + relative_path_in_archive);
     }
+    if (pending_it != pending_index.end()) {
+        pending_changes.erase(pending_changes.begin() + pending_it->second);
+        pending_index.clear();
+        for (size_t i = 0; i < pending_changes.size(); ++i) {
+            pending_index.emplace(pending_changes[i].relative_path, i);
+        }
+    }
+    if (exists) {
+        pending_removals.insert(relative_path_in_archive);
+    }
+}
+
+uint64_t GFSEdit::_change_size(const PendingChange& change) {
+    return change.source_length == WHOLE_FILE ? fs::file_size(change.source_path) : change.source_length;
+}
 
-    pending_changes.push_back({
-        relative_path_in_archive,
-        file_path,
-        meta_it == files_meta_data.end() // is_new
-        });
+void GFSEdit::set_alignment(uint32_t new_alignment, bool realign_existing) {
+    alignment = std::max(new_alignment, 1u);
+    if (realign_existing) {
+        std::fill(files_meta_data.alignment.begin(), files_meta_data.alignment.end(), alignment);
+        for (auto& change : pending_changes) {
+            change.alignment = alignment;
+        }
+        layout_changed = true;
+    }
 }
 
 void GFSEdit::add_files(const fs::path& files_path, const std::string& relative_path_in_archive, bool replace_existing) {
@@ -168,93 +374,239 @@ void GFSEdit::add_files(const fs::path& files_path, const std::string& relative_
 }
 
 void GFSEdit::extract_file(const std::string& relative_path_in_archive, const fs::path& output_path) {
-    auto it = std::find_if(
-        files_meta_data.begin(),
-        files_meta_data.end(),
-        [&](const FileMetaData& meta)
-        { return meta.relative_path == relative_path_in_archive; });
-
-    if (it == files_meta_data.end()) {
+    auto index_it = meta_index.find(relative_path_in_archive);
+    if (index_it == meta_index.end()) {
         throw std::runtime_error("File not found in archive: " + relative_path_in_archive);
     }
+    size_t idx = index_it->second;
 
     fs::create_directories(output_path.parent_path());
 
-    HANDLE ext_FILE = CreateFile(
-        output_path.c_str(),
-        GENERIC_READ | GENERIC_WRITE,
-        0,
-        NULL,
-        OPEN_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
-
-    if (ext_FILE == INVALID_HANDLE_VALUE) {
-        throw std::runtime_error("Failed to create output file: " + output_path.string());
-    }
-
-
-
-    LARGE_INTEGER liOffset;
-    liOffset.QuadPart = header.data_offset + it->data_offset;
-    if (!SetFilePointerEx(hFile, liOffset, NULL, FILE_BEGIN)) {
-        throw std::runtime_error("Failed to set file pointer in archive");
-    }
-
-    std::vector<unsigned char> buffer(it->data_length);
-
-
-    if (!ReadFile(hFile, buffer.data(), (DWORD)buffer.size(), NULL, NULL)) {
-        throw std::runtime_error("Failed to read from archive");
+    // The archive is mapped on first extraction and dropped again by commit_changes
+    if (!archive_map) {
+        archive_map = file_io::mapped_file(hFile);
     }
-
-    if (!WriteFile(ext_FILE, buffer.data(), (DWORD)buffer.size(), NULL, NULL)) {
-        throw std::runtime_error("Failed to write to output file");
-    }
-
-    CloseHandle(ext_FILE);
+    file_io::write_file(output_path, archive_map.bytes(header.data_offset + files_meta_data.data_offset[idx], files_meta_data.data_length[idx]));
 }
 
-void GFSEdit::extract_files(const fs::path& output_path, const std::string& relative_path_in_archive) {
+void GFSEdit::extract_files(const fs::path& output_path, const std::string& relative_path_in_archive, unsigned jobs) {
     //    :  /     
     std::string search_path = relative_path_in_archive;
     if (!search_path.empty() && search_path.back() != '/') {
         search_path += '/';
     }
 
-    for (const auto& meta : files_meta_data) {
+    if (!archive_map) {
+        archive_map = file_io::mapped_file(hFile);
+    }
+    // Entries below search_path form one contiguous run of the sorted index,
+    // the exact match (a single file) sorts right in front of it
+    auto first = sorted_meta.begin();
+    auto last = sorted_meta.end();
+    if (!search_path.empty()) {
+        auto path_less = [&](size_t idx, const std::string& path) {
+            return files_meta_data.path(idx) < path;
+        };
+        first = std::lower_bound(sorted_meta.begin(), sorted_meta.end(), relative_path_in_archive, path_less);
+        last = std::lower_bound(first, sorted_meta.end(), search_path, path_less);
+        while (last != sorted_meta.end() &&
+            files_meta_data.path(*last).compare(0, search_path.size(), search_path) == 0) {
+            ++last;
+        }
+    }
+    std::vector<size_t> matches(first, last);
+    // Extract in archive order: write_files keeps the first task of a
+    // duplicated path, the entry extract_file picks as well
+    std::sort(matches.begin(), matches.end());
+
+    std::vector<file_io::write_task> tasks;
+    std::vector<size_t> task_meta;
+    for (size_t match : matches) {
+        std::string_view relative_path = files_meta_data.path(match);
         //     
         if (search_path.empty() ||
-            meta.relative_path == relative_path_in_archive ||
-            (meta.relative_path.size() > search_path.size() &&
-                meta.relative_path.substr(0, search_path.size()) == search_path)) {
+            relative_path == relative_path_in_archive ||
+            (relative_path.size() > search_path.size() &&
+                relative_path.compare(0, search_path.size(), search_path) == 0)) {
 
             //     
             fs::path full_output_path = output_path;
-            if (!search_path.empty()) {
+            if (relative_path == relative_path_in_archive) {
+                full_output_path /= fs::path(relative_path).filename();
+            }
+            else if (!search_path.empty()) {
                 //      
-                std::string relative_part = meta.relative_path.substr(search_path.size());
-                full_output_path /= relative_part;
+                full_output_path /= relative_path.substr(search_path.size());
             }
             else {
-                full_output_path /= meta.relative_path;
+                full_output_path /= relative_path;
             }
 
             try {
-                extract_file(meta.relative_path, full_output_path);
+                tasks.push_back({ archive_map.bytes(header.data_offset + files_meta_data.data_offset[match], files_meta_data.data_length[match]), full_output_path });
+                task_meta.push_back(match);
             }
             catch (const std::exception& e) {
-                std::cerr << "Error extracting file " << meta.relative_path << ": " << e.what() << std::endl;
+                std::cerr << "Error extracting file " << relative_path << ": " << e.what() << std::endl;
+            }
+        }
+    }
+
+    for (const auto& failure : file_io::write_files(tasks, jobs)) {
+        std::cerr << "Error extracting file " << files_meta_data.path(task_meta[failure.task_index]) << ": " << failure.message << std::endl;
+    }
+}
+
+bool GFSEdit::_commit_in_place() {
+    // New entries go behind the last entry and their records into the slack
+    // after the metadata table. Replacements can only be written over the old
+    // bytes when the size stays the same, anything else needs a full rewrite.
+    uint64_t new_records_size = 0;
+    uint64_t data_end = header.data_offset;
+    for (size_t i = 0; i < files_meta_data.size(); ++i) {
+        data_end = std::max(data_end, header.data_offset + files_meta_data.data_offset[i] + files_meta_data.data_length[i]);
+    }
+    std::vector<uint64_t> change_sizes;
+    change_sizes.reserve(pending_changes.size());
+    // Offsets of the replaced entries, looked up before the table grows
+    std::vector<uint64_t> target_offsets;
+    target_offsets.reserve(pending_changes.size());
+    for (const auto& change : pending_changes) {
+        uint64_t change_size = _change_size(change);
+        change_sizes.push_back(change_size);
+        if (change.is_new) {
+            new_records_size += 8 + change.relative_path.size() + 8 + 4;
+            target_offsets.push_back(0);
+        }
+        else {
+            size_t idx = meta_index.at(change.relative_path);
+            // A duplicated path would keep its other copies, the full rewrite drops them
+            if (files_meta_data.data_length[idx] != change_size || has_duplicate_paths) {
+                return false;
+            }
+            target_offsets.push_back(files_meta_data.data_offset[idx]);
+        }
+    }
+    if (header.metadata_end + new_records_size > header.data_offset) {
+        return false;
+    }
+    LARGE_INTEGER liSize;
+    if (!GetFileSizeEx(hFile, &liSize) || (uint64_t)liSize.QuadPart != data_end) {
+        // Trailing bytes after the last entry would shift everything appended
+        return false;
+    }
+
+    archive_map = file_io::mapped_file();
+    std::vector<unsigned char> records;
+    records.reserve((size_t)new_records_size);
+    // Offsets of the new entries. The table only takes them once their records
+    // are on disk, so a failed commit leaves it as it was
+    std::vector<std::pair<size_t, uint64_t>> added;
+    uint64_t append_offset = data_end - header.data_offset;
+    for (size_t i = 0; i < pending_changes.size(); ++i) {
+        const auto& change = pending_changes[i];
+        if (change.is_new) {
+            append_offset = align_up(header.data_offset + append_offset, change.alignment) - header.data_offset;
+        }
+        HANDLE change_hFile = CreateFile(
+            change.source_path.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+            NULL
+        );
+        if (change_hFile == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Failed to handle for change file: " + change.source_path.string());
+        }
+
+        uint64_t target_offset = change.is_new ? append_offset : target_offsets[i];
+        LARGE_INTEGER liTarget;
+        liTarget.QuadPart = header.data_offset + target_offset;
+        try {
+            if (!SetFilePointerEx(hFile, liTarget, NULL, FILE_BEGIN)) {
+                throw std::runtime_error("Failed to set file pointer: " + gfs_path.string());
             }
+            file_io::copy_range(change_hFile, change.source_offset, hFile, change_sizes[i]);
+        }
+        catch (...) {
+            CloseHandle(change_hFile);
+            throw;
         }
+        CloseHandle(change_hFile);
+
+        if (change.is_new) {
+            append_byteswapped(records, uint64_t(change.relative_path.size()));
+            records.insert(records.end(), change.relative_path.begin(), change.relative_path.end());
+            append_byteswapped(records, change_sizes[i]);
+            append_byteswapped(records, change.alignment);
+            added.emplace_back(i, append_offset);
+            append_offset += change_sizes[i];
+        }
+    }
+    // An empty last entry still has to find its padding on disk
+    LARGE_INTEGER liDataEnd;
+    liDataEnd.QuadPart = header.data_offset + append_offset;
+    if (!GetFileSizeEx(hFile, &liSize)) {
+        throw std::runtime_error("Failed to get file size: " + gfs_path.string());
+    }
+    if (liSize.QuadPart < liDataEnd.QuadPart &&
+        (!SetFilePointerEx(hFile, liDataEnd, NULL, FILE_BEGIN) || !SetEndOfFile(hFile))) {
+        throw std::runtime_error("Failed to extend archive: " + gfs_path.string());
+    }
+
+    // The data has to be on disk before the table points at it
+    if (!FlushFileBuffers(hFile)) {
+        throw std::runtime_error("Failed to flush archive: " + gfs_path.string());
+    }
+    LARGE_INTEGER liMetaEnd;
+    liMetaEnd.QuadPart = header.metadata_end;
+    if (!SetFilePointerEx(hFile, liMetaEnd, NULL, FILE_BEGIN)) {
+        throw std::runtime_error("Failed to set file pointer: " + gfs_path.string());
+    }
+    file_io::write_all(hFile, records);
+
+    std::vector<unsigned char> count_buffer;
+    append_byteswapped(count_buffer, uint64_t(files_meta_data.size() + added.size()));
+    LARGE_INTEGER liCount;
+    liCount.QuadPart = HEADER_COUNT_FILES_OFFSET;
+    if (!SetFilePointerEx(hFile, liCount, NULL, FILE_BEGIN)) {
+        throw std::runtime_error("Failed to set file pointer: " + gfs_path.string());
+    }
+    file_io::write_all(hFile, count_buffer);
+    if (!FlushFileBuffers(hFile)) {
+        throw std::runtime_error("Failed to flush archive: " + gfs_path.string());
+    }
+
+    for (const auto& [i, offset] : added) {
+        const auto& change = pending_changes[i];
+        files_meta_data.push_back(change.relative_path, change_sizes[i], offset, change.alignment);
+    }
+    header.count_of_files = files_meta_data.size();
+    header.metadata_end += records.size();
+    metadata_reserve = uint32_t(header.data_offset - header.metadata_end);
+    pending_changes.clear();
+    _build_index();
+    return true;
+}
+
+void GFSEdit::commit_changes(bool allow_in_place) {
+    if (pending_changes.empty() && pending_removals.empty() && !layout_changed) return;
+    if (allow_in_place && pending_removals.empty() && !layout_changed) {
+        trace::scope phase("commit.in_place");
+        if (_commit_in_place()) return;
     }
+    _commit_rewrite(gfs_path);
 }
 
-void GFSEdit::commit_changes() {
-    if (pending_changes.empty()) return;
+void GFSEdit::commit_as(const fs::path& output_path) {
+    _commit_rewrite(output_path);
+}
 
-    const fs::path temp_path = gfs_path.string() + ".tmp";
+void GFSEdit::_commit_rewrite(const fs::path& output_path) {
+    trace::scope phase("commit.metadata");
+    const fs::path temp_path = output_path.string() + ".tmp";
     HANDLE Temp_hFile = INVALID_HANDLE_VALUE;
     try {
         uint32_t old_offset = header.data_offset;
@@ -273,76 +625,93 @@ void GFSEdit::commit_changes() {
         }
 
         std::vector<unsigned char> buffer(HEADER_SIZE);
-        std::erase_if(files_meta_data,
-            [&](const auto& meta) {
-                return std::any_of(
-                    pending_changes.begin(),
-                    pending_changes.end(),
-                    [&](const PendingChange& pc) {
-                        return !pc.is_new && pc.relative_path == meta.relative_path;
-                    });
+        files_meta_data.erase_if(
+            [&](size_t idx) {
+                std::string_view relative_path = files_meta_data.path(idx);
+                auto pending_it = pending_index.find(relative_path);
+                return (pending_it != pending_index.end() && !pending_changes[pending_it->second].is_new) ||
+                    pending_removals.count(relative_path) != 0;
             });
 
-        for (const auto& meta : files_meta_data) {
-            append_byteswapped(buffer, uint64_t(meta.relative_path.size()));
-            buffer.insert(buffer.end(),
-                meta.relative_path.c_str(),
-                meta.relative_path.c_str() + meta.relative_path.size());
-            append_byteswapped(buffer, meta.data_length);
-            append_byteswapped(buffer, uint32_t(1));
+        std::vector<uint64_t> change_sizes;
+        change_sizes.reserve(pending_changes.size());
+        for (const auto& change : pending_changes) {
+            change_sizes.push_back(_change_size(change));
         }
 
-        for (const auto& change : pending_changes) {
+        for (size_t m = 0; m < files_meta_data.size(); ++m) {
+            std::string_view relative_path = files_meta_data.path(m);
+            append_byteswapped(buffer, uint64_t(relative_path.size()));
+            buffer.insert(buffer.end(), relative_path.begin(), relative_path.end());
+            append_byteswapped(buffer, files_meta_data.data_length[m]);
+            append_byteswapped(buffer, files_meta_data.alignment[m]);
+        }
+
+        for (size_t c = 0; c < pending_changes.size(); ++c) {
+            const auto& change = pending_changes[c];
             append_byteswapped(buffer, uint64_t(change.relative_path.size()));
             buffer.insert(buffer.end(),
                 change.relative_path.c_str(),
                 change.relative_path.c_str() + change.relative_path.size());
-            append_byteswapped(buffer, uint64_t(fs::file_size(change.source_path)));
-            append_byteswapped(buffer, uint32_t(1));
+            append_byteswapped(buffer, change_sizes[c]);
+            append_byteswapped(buffer, change.alignment);
+        }
+        header.metadata_end = buffer.size();
+        buffer.resize(buffer.size() + metadata_reserve);
+        // On block cloning volumes keep the data at the same position within a
+        // cluster, so the unchanged runs can be cloned instead of copied
+        const uint32_t cluster = file_io::block_clone_granularity(Temp_hFile);
+        if (cluster != 0) {
+            buffer.resize(buffer.size() + (old_offset % cluster + cluster - buffer.size() % cluster) % cluster);
         }
         header.data_offset = (uint32_t)buffer.size();
         header.count_of_files = files_meta_data.size() + pending_changes.size();
-        uint32_t BE_data_offset = compat::byteswap(uint32_t(header.data_offset));
-        uint64_t BE_count_of_files = compat::byteswap(uint64_t(header.count_of_files));
-        uint64_t BE_file_indidentifier_size = compat::byteswap(uint64_t(FILE_IDENTIFIER.size()));
-        uint64_t BE_file_version_size = compat::byteswap(uint64_t(FILE_VERSION.size()));
         size_t ptr{ 0 };
-        std::memcpy(buffer.data() + ptr, &BE_data_offset, sizeof(BE_data_offset));
-        ptr += sizeof(BE_data_offset);
-        std::memcpy(buffer.data() + ptr, &BE_file_indidentifier_size, sizeof(BE_file_indidentifier_size));
-        ptr += sizeof(BE_file_indidentifier_size);
+        byte_order::store_be(buffer.data() + ptr, uint32_t(header.data_offset));
+        ptr += sizeof(uint32_t);
+        byte_order::store_be(buffer.data() + ptr, uint64_t(FILE_IDENTIFIER.size()));
+        ptr += sizeof(uint64_t);
         std::memcpy(buffer.data() + ptr, FILE_IDENTIFIER.data(), FILE_IDENTIFIER.size());
         ptr += FILE_IDENTIFIER.size();
-        std::memcpy(buffer.data() + ptr, &BE_file_version_size, sizeof(BE_file_version_size));
-        ptr += sizeof(BE_file_version_size);
+        byte_order::store_be(buffer.data() + ptr, uint64_t(FILE_VERSION.size()));
+        ptr += sizeof(uint64_t);
         std::memcpy(buffer.data() + ptr, FILE_VERSION.data(), FILE_VERSION.size());
         ptr += FILE_VERSION.size();
-        std::memcpy(buffer.data() + ptr, &BE_count_of_files, sizeof(BE_count_of_files));
-        if (!WriteFile(Temp_hFile, buffer.data(), (DWORD)buffer.size(), NULL, NULL)) {
-            throw std::runtime_error("Failed to write for: " + temp_path.string());
-        }
+        byte_order::store_be(buffer.data() + ptr, uint64_t(header.count_of_files));
+        file_io::write_all(Temp_hFile, buffer);
         buffer.clear();
-        size_t i = 0;
-        LARGE_INTEGER liOldOffset;
-        liOldOffset.QuadPart = old_offset;
-        if (!SetFilePointerEx(hFile, liOldOffset, NULL, FILE_BEGIN)) {
-            throw std::runtime_error("Failed to set file pointer: " + gfs_path.string());
+
+        // New layout: every entry at the next multiple of its alignment
+        std::vector<uint64_t> new_offsets;
+        new_offsets.reserve(files_meta_data.size() + pending_changes.size());
+        uint64_t data_end = header.data_offset;
+        for (size_t m = 0; m < files_meta_data.size(); ++m) {
+            data_end = align_up(data_end, files_meta_data.alignment[m]);
+            new_offsets.push_back(data_end - header.data_offset);
+            data_end += files_meta_data.data_length[m];
+        }
+        for (size_t c = 0; c < pending_changes.size(); ++c) {
+            data_end = align_up(data_end, pending_changes[c].alignment);
+            new_offsets.push_back(data_end - header.data_offset);
+            data_end += change_sizes[c];
         }
 
+        phase.next("commit.copy_unchanged");
+        size_t i = 0;
+        // Unchanged entries that keep their distance to each other (padding
+        // included) are copied as one run
+        const auto& old_offsets = files_meta_data.data_offset;
+        const auto& lengths = files_meta_data.data_length;
         while (i < files_meta_data.size()) {
-            uint64_t current_offset = files_meta_data[i].data_offset;
-            uint64_t total_size = files_meta_data[i].data_length;
+            uint64_t current_offset = old_offsets[i];
+            uint64_t run_end = current_offset + lengths[i];
             size_t files_in_block = 1;
 
             while (i + files_in_block < files_meta_data.size()) {
-                uint64_t expected_offset = files_meta_data[i + files_in_block - 1].data_offset + files_meta_data[i + files_in_block - 1].data_length;
-
-                if (expected_offset == files_meta_data[i + files_in_block].data_offset) {
-
-                    if (total_size + files_meta_data[i + files_in_block].data_length > MAX_BUFFER_SIZE) {
-                        break;
-                    }
-                    total_size += files_meta_data[i + files_in_block].data_length;
+                size_t next = i + files_in_block;
+                if (old_offsets[next] >= run_end &&
+                    old_offsets[next] - current_offset == new_offsets[next] - new_offsets[i]) {
+                    run_end = old_offsets[next] + lengths[next];
                     files_in_block++;
                 }
                 else {
@@ -350,71 +719,58 @@ void GFSEdit::commit_changes() {
                 }
             }
 
-
-            buffer.resize(total_size);
-            LARGE_INTEGER liCurrent;
-            liCurrent.QuadPart = current_offset + old_offset;
-            if (!SetFilePointerEx(hFile, liCurrent, NULL, FILE_BEGIN)) {
-                throw std::runtime_error("Failed to set file pointer: " + gfs_path.string());
-            }
-
-            if (!ReadFile(hFile, buffer.data(), (DWORD)buffer.size(), NULL, NULL)) {
-                throw std::runtime_error("Failed to read File Data: " + gfs_path.string());
-            }
-
-            if (!WriteFile(Temp_hFile, buffer.data(), (DWORD)buffer.size(), NULL, NULL)) {
-                throw std::runtime_error("Failed to write File Data: " + temp_path.string());
-            }
-
-
+            file_io::clone_range(hFile, current_offset + old_offset, Temp_hFile, header.data_offset + new_offsets[i], run_end - current_offset, cluster);
             i += files_in_block;
-            buffer.clear();
         }
-        buffer.clear();
-        for (const auto& change : pending_changes) {
+        std::copy(new_offsets.begin(), new_offsets.begin() + files_meta_data.size(), files_meta_data.data_offset.begin());
+
+        phase.next("commit.copy_changes");
+
+        for (size_t c = 0; c < pending_changes.size(); ++c) {
+            const auto& change = pending_changes[c];
             HANDLE change_hFile = CreateFile(
                 change.source_path.c_str(),
-                GENERIC_READ | GENERIC_WRITE,
-                0,
+                GENERIC_READ,
+                FILE_SHARE_READ,
                 NULL,
                 OPEN_EXISTING,
-                FILE_ATTRIBUTE_NORMAL,
+                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
                 NULL
             );
             if (change_hFile == INVALID_HANDLE_VALUE) {
-                CloseHandle(change_hFile);
                 throw std::runtime_error("Failed to handle for change file: " + change.source_path.string());
             }
 
-            size_t change_file_size = fs::file_size(change.source_path);
-            if (change_file_size > MAX_BUFFER_SIZE) {
-                throw std::runtime_error("File too big: " + change.source_path.string());
-            }
-            buffer.resize(change_file_size);
-            if (!ReadFile(change_hFile, buffer.data(), (DWORD)buffer.size(), NULL, NULL)) {
-                throw std::runtime_error("Failed to read File Data: " + gfs_path.string());
-            }
-
-            if (!WriteFile(Temp_hFile, buffer.data(), (DWORD)buffer.size(), NULL, NULL)) {
-                throw std::runtime_error("Failed to write File Data: " + temp_path.string());
+            uint64_t change_offset = new_offsets[files_meta_data.size()];
+            LARGE_INTEGER liTarget;
+            liTarget.QuadPart = header.data_offset + change_offset;
+            try {
+                if (!SetFilePointerEx(Temp_hFile, liTarget, NULL, FILE_BEGIN)) {
+                    throw std::runtime_error("Failed to set file pointer: " + temp_path.string());
+                }
+                file_io::copy_range(change_hFile, change.source_offset, Temp_hFile, change_sizes[c]);
             }
-            LARGE_INTEGER liEndPos;
-            if (!SetFilePointerEx(Temp_hFile, { 0 }, &liEndPos, FILE_END)) {
-                throw std::runtime_error("Failed to get file pointer");
+            catch (...) {
+                CloseHandle(change_hFile);
+                throw;
             }
-            buffer.clear();
             CloseHandle(change_hFile);
-            files_meta_data.emplace_back(FileMetaData{
-                 change.relative_path,
-                 change_file_size,
-                 (uint64_t)liEndPos.QuadPart - change_file_size - header.data_offset
-                });
+            files_meta_data.push_back(change.relative_path, change_sizes[c], change_offset, change.alignment);
+        }
+        // Padding in front of an empty last entry is never written, extend to it
+        LARGE_INTEGER liDataEnd;
+        liDataEnd.QuadPart = data_end;
+        if (!SetFilePointerEx(Temp_hFile, liDataEnd, NULL, FILE_BEGIN) || !SetEndOfFile(Temp_hFile)) {
+            throw std::runtime_error("Failed to set end of file: " + temp_path.string());
         }
 
+        phase.next("commit.replace");
         CloseHandle(Temp_hFile);
+        archive_map = file_io::mapped_file();
         CloseHandle(hFile);
-        fs::remove(gfs_path);
-        fs::rename(temp_path, gfs_path);
+        fs::remove(output_path);
+        fs::rename(temp_path, output_path);
+        gfs_path = output_path;
 
         hFile = CreateFile(
             gfs_path.c_str(),
@@ -427,6 +783,9 @@ void GFSEdit::commit_changes() {
         );
 
         pending_changes.clear();
+        pending_removals.clear();
+        layout_changed = false;
+        _build_index();
     }
     catch (const std::exception& e) {
 
@@ -434,122 +793,655 @@ void GFSEdit::commit_changes() {
             CloseHandle(Temp_hFile);
             fs::remove(temp_path);
         }
+        // The table may have changed under the index keys
+        _build_index();
         std::cout << e.what();
         throw;
     }
 }
 
+uint64_t GFSUnpacker::memory_estimate(const std::filesystem::path& archive) {
+    uint64_t table_size = 0;
+    try {
+        file_io::mapped_file map(archive);
+        auto bytes = map.bytes(0, 4);
+        table_size = byte_order::load_be<uint32_t>(bytes.data());
+    }
+    catch (const std::exception&) {
+        // Unreadable archives fail as soon as they run
+    }
+    // Parsed entries and write tasks take a few times the raw table
+    return table_size * 4 + file_io::COPY_CHUNK_SIZE;
+}
+
 void GFSUnpacker::operator()(const std::filesystem::path& filetounpackcs) {
-    std::filesystem::path filetounpack = filetounpackcs;
-    unsigned __int64 number_of_files{ 0 };
-    unsigned int offset_to_filedata{ 0 };
-    FILE* fGFSMetaInfo = _wfopen(filetounpack.c_str(), L"rb");
-    FILE* fGFSFileData = _wfopen(filetounpack.c_str(), L"rb");
-    std::fread(&offset_to_filedata, sizeof offset_to_filedata, 1, fGFSMetaInfo);
-    offset_to_filedata = compat::byteswap((uint32_t)offset_to_filedata);
-    _fseeki64(fGFSMetaInfo, (__int64)(0x2B), SEEK_SET);
-    std::fread(&number_of_files, sizeof number_of_files, 1, fGFSMetaInfo);
-    number_of_files = compat::byteswap((uint64_t)number_of_files);
-    _fseeki64(fGFSMetaInfo, (__int64)(0x33), SEEK_SET);
-    uint64_t Files_Lenght{ 0 };
-    for (uint64_t i{ 0 }; i < number_of_files; i++) {
-        MetaInfo CurrentFile;
-
-        std::fread(&CurrentFile.File_Path_Lenght, 0x8, 1, fGFSMetaInfo);
-        CurrentFile.File_Path_Lenght = compat::byteswap((uint64_t)CurrentFile.File_Path_Lenght);
-
-        CurrentFile.File_Path.resize(CurrentFile.File_Path_Lenght);
-        std::fread(reinterpret_cast<char*>(CurrentFile.File_Path.data()), CurrentFile.File_Path_Lenght, 1, fGFSMetaInfo);
-
-        std::fread(&CurrentFile.File_Lenght, 0x8, 1, fGFSMetaInfo);
-        CurrentFile.File_Lenght = compat::byteswap((uint64_t)CurrentFile.File_Lenght);
-
-        _fseeki64(fGFSMetaInfo, (__int64)(0x4), SEEK_CUR);
-
-        //Read File Data		
-        std::vector<char> FileData(CurrentFile.File_Lenght);
-
-        _fseeki64(fGFSFileData, (__int64)(offset_to_filedata + Files_Lenght), SEEK_SET);
-        std::fread(reinterpret_cast<char*>(FileData.data()), CurrentFile.File_Lenght, 1, fGFSFileData);
-
-        //Now we ready to write
-
-        std::string path(CurrentFile.File_Path.begin(), CurrentFile.File_Path.end());
-        std::filesystem::path filetowrite = filetounpack.replace_extension("") / path;
+    std::filesystem::path output_dir = filetounpackcs;
+    output_dir.replace_extension("");
+    trace::scope phase("unpack.open");
+    GFSView archive(filetounpackcs);
+
+    std::vector<file_io::write_task> tasks;
+    tasks.reserve(archive.entries().size());
+    for (const auto& entry : archive.entries()) {
+        std::filesystem::path filetowrite = output_dir / entry.relative_path;
         filetowrite.make_preferred();
-        std::filesystem::create_directories(filetowrite.parent_path());
-        std::ofstream file(filetowrite, std::ios::out | std::ifstream::binary);
-        file.write(reinterpret_cast<char*>(FileData.data()), CurrentFile.File_Lenght);
-        file.close();
-
-        Files_Lenght += CurrentFile.File_Lenght;
+        tasks.push_back({ archive.data(entry), std::move(filetowrite) });
+    }
+    phase.next("unpack.write");
+    auto failures = queue_depth > 0 ? file_io::write_files_overlapped(tasks, queue_depth) : file_io::write_files(tasks, jobs);
+    for (const auto& failure : failures) {
+        std::cerr << "Error extracting file " << archive.entries()[failure.task_index].relative_path << ": " << failure.message << std::endl;
     }
 }
 
+uint64_t GFSPacker::memory_estimate() const {
+    // Same choice of reader as operator()
+    if (queue_depth > 0) return file_io::MAX_BYTES_IN_FLIGHT + file_io::COPY_CHUNK_SIZE;
+    if (jobs > 1 || incremental) return uint64_t(jobs) * 2 * file_io::COPY_CHUNK_SIZE + file_io::COPY_CHUNK_SIZE;
+    return file_io::COPY_CHUNK_SIZE;
+}
+
 void GFSPacker::operator()(const std::filesystem::path& filestopackcs) {
 
     struct FileInfo {
         std::filesystem::path full_path;
         std::string relative_path;
         uint64_t size;
+        int64_t mtime;
     };
     std::vector<FileInfo> files;
     unsigned int offset_to_filedata{ 0x33 };
+    trace::scope phase("pack.walk");
 
     for (const auto& dir_entry : std::filesystem::recursive_directory_iterator(filestopackcs)) {
         if (dir_entry.is_regular_file()) {
             std::string pathString = dir_entry.path().generic_string().erase(0, filestopackcs.generic_string().size() + 1);
             uint64_t filesize = std::filesystem::file_size(dir_entry.path());
-            files.push_back({ dir_entry.path(), pathString, filesize });
+            int64_t mtime = (int64_t)dir_entry.last_write_time().time_since_epoch().count();
+            files.push_back({ dir_entry.path(), pathString, filesize, mtime });
             offset_to_filedata += (uint32_t)(8 + pathString.size() + 8 + 4);
         }
     }
+    offset_to_filedata += metadata_reserve;
 
     std::filesystem::path pathGFS = filestopackcs.parent_path() / filestopackcs.filename();
     pathGFS.replace_extension(".gfs");
 
-    FILE* fGFS = _wfopen(pathGFS.c_str(), L"wb");
-    if (!fGFS) return;
+    phase.next("pack.reuse_check");
+    // Incremental packing: entries whose source file still matches the manifest
+    // are copied out of the previous archive instead of being read again
+    const uint64_t NOT_REUSED = UINT64_MAX;
+    std::vector<uint64_t> reused_offset(files.size(), NOT_REUSED);
+    std::vector<std::optional<uint32_t>> crcs(files.size());
+    std::optional<GFSView> previous;
+    if (incremental) {
+        auto manifest = read_manifest(pathGFS);
+        if (!manifest.empty()) {
+            previous.emplace(pathGFS);
+            std::unordered_map<std::string_view, const GFSView::Entry*> old_entries;
+            old_entries.reserve(previous->entries().size());
+            for (const auto& entry : previous->entries()) {
+                old_entries.emplace(entry.relative_path, &entry);
+            }
+            // With compare_hashes the candidates are read back below, write
+            // times are not trusted, only the content decides
+            std::vector<file_io::read_request> hash_requests;
+            std::vector<size_t> hash_file;
+            std::vector<uint32_t> hash_expected;
+            std::vector<uint64_t> hash_offset;
+            for (size_t i = 0; i < files.size(); ++i) {
+                auto recorded = manifest.find(files[i].relative_path);
+                auto old_entry = old_entries.find(files[i].relative_path);
+                if (recorded == manifest.end() || old_entry == old_entries.end() ||
+                    recorded->second.size != files[i].size || old_entry->second->data_length != files[i].size) {
+                    continue;
+                }
+                if (compare_hashes) {
+                    if (recorded->second.has_crc) {
+                        hash_requests.push_back({ files[i].full_path, 0, files[i].size });
+                        hash_file.push_back(i);
+                        hash_expected.push_back(recorded->second.crc);
+                        hash_offset.push_back(old_entry->second->data_offset);
+                    }
+                    continue;
+                }
+                if (recorded->second.mtime != files[i].mtime) {
+                    continue;
+                }
+                reused_offset[i] = old_entry->second->data_offset;
+                if (recorded->second.has_crc) {
+                    crcs[i] = recorded->second.crc;
+                }
+            }
 
-    // Write placeholder header
-    std::vector<char> placeholder(0x33, 0);
-    std::fwrite(placeholder.data(), 1, placeholder.size(), fGFS);
+            if (!hash_requests.empty()) {
+                // Same reader pool as the data reads of the pack itself
+                uint32_t crc{ 0 };
+                auto check_piece = [&](size_t request, uint64_t offset, std::span<const unsigned char> data) {
+                    crc = checksum::crc32c(data, offset == 0 ? 0 : crc);
+                    if (offset + data.size() == hash_requests[request].length && crc == hash_expected[request]) {
+                        reused_offset[hash_file[request]] = hash_offset[request];
+                        crcs[hash_file[request]] = crc;
+                    }
+                };
+                if (queue_depth > 0) {
+                    file_io::read_in_order_overlapped(hash_requests, queue_depth, check_piece);
+                }
+                else {
+                    file_io::read_in_order(hash_requests, jobs, check_piece);
+                }
+            }
+        }
+    }
 
-    // Write metadata entries
+    phase.next("pack.metadata");
+    // Header and metadata entries go out in a single write
+    std::vector<unsigned char> meta_buffer;
+    meta_buffer.reserve(offset_to_filedata);
+    append_byteswapped(meta_buffer, uint32_t(offset_to_filedata));
+    meta_buffer.insert(meta_buffer.end(), (unsigned char*)&file_identifier_length, (unsigned char*)&file_identifier_length + 8);
+    meta_buffer.insert(meta_buffer.end(), file_identifier, file_identifier + 20);
+    meta_buffer.insert(meta_buffer.end(), (unsigned char*)&file_version_length, (unsigned char*)&file_version_length + 8);
+    meta_buffer.insert(meta_buffer.end(), file_version, file_version + 3);
+    append_byteswapped(meta_buffer, uint64_t(files.size()));
     for (const auto& file : files) {
-        uint64_t i_file_path_lenght = compat::byteswap(uint64_t(file.relative_path.size()));
-        uint64_t FileSize = compat::byteswap(uint64_t(file.size));
+        append_byteswapped(meta_buffer, uint64_t(file.relative_path.size()));
+        meta_buffer.insert(meta_buffer.end(), file.relative_path.begin(), file.relative_path.end());
+        append_byteswapped(meta_buffer, uint64_t(file.size));
+        meta_buffer.insert(meta_buffer.end(), (unsigned char*)&file_aligned, (unsigned char*)&file_aligned + 4);
+    }
+    meta_buffer.resize(offset_to_filedata);
 
-        std::fwrite(&i_file_path_lenght, 8, 1, fGFS);
-        std::fwrite(file.relative_path.data(), file.relative_path.size(), 1, fGFS);
-        std::fwrite(&FileSize, 8, 1, fGFS);
-        std::fwrite(&file_aligned, 4, 1, fGFS);
+    // The previous archive is still being read from, so the new one is built
+    // next to it and moved over it at the end
+    fs::path output_path = pathGFS;
+    if (previous) {
+        output_path += ".tmp";
+    }
+    HANDLE hGFS = CreateFile(
+        output_path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+    if (hGFS == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Failed to create archive: " + output_path.string());
     }
 
-    // Write file data
-    for (const auto& file : files) {
-        FILE* CurrentFile = _wfopen(file.full_path.c_str(), L"rb");
-        if (CurrentFile) {
-            if (file.size > 0) {
-                std::vector<unsigned char> buffer(file.size);
-                std::fread(reinterpret_cast<char*>(buffer.data()), (size_t)file.size, 1, CurrentFile);
-                std::fwrite(reinterpret_cast<char*>(buffer.data()), (size_t)file.size, 1, fGFS);
+    try {
+        file_io::write_all(hGFS, meta_buffer);
+
+        phase.next("pack.data");
+        // Write file data, skipping ahead over the alignment padding
+        uint64_t position = offset_to_filedata;
+        auto skip_padding = [&] {
+            if (align_up(position, alignment) != position) {
+                position = align_up(position, alignment);
+                LARGE_INTEGER liPosition;
+                liPosition.QuadPart = position;
+                if (!SetFilePointerEx(hGFS, liPosition, NULL, FILE_BEGIN)) {
+                    throw std::runtime_error("Failed to set file pointer: " + output_path.string());
+                }
+            }
+        };
+        // Copies the reused entries in front of `end` out of the previous
+        // archive. Neighbours that keep their spacing go out as one range.
+        const uint32_t cluster = previous ? file_io::block_clone_granularity(hGFS) : 0;
+        size_t next_file = 0;
+        auto copy_reused = [&](size_t end) {
+            while (next_file < end) {
+                skip_padding();
+                size_t run_end = next_file + 1;
+                uint64_t run_position = position + files[next_file].size;
+                while (run_end < end) {
+                    uint64_t next_position = align_up(run_position, alignment);
+                    if (reused_offset[run_end] - reused_offset[next_file] != next_position - position) {
+                        break;
+                    }
+                    run_position = next_position + files[run_end].size;
+                    ++run_end;
+                }
+                file_io::clone_range(previous->handle(), reused_offset[next_file], hGFS, position, run_position - position, cluster);
+                position = run_position;
+                next_file = run_end;
             }
-            std::fclose(CurrentFile);
+        };
+        if (jobs > 1 || incremental || queue_depth > 0) {
+            // Reader threads prefetch the upcoming files while this thread writes
+            std::vector<file_io::read_request> requests;
+            std::vector<size_t> request_file;
+            for (size_t i = 0; i < files.size(); ++i) {
+                if (reused_offset[i] == NOT_REUSED) {
+                    requests.push_back({ files[i].full_path, 0, files[i].size });
+                    request_file.push_back(i);
+                }
+            }
+            uint32_t crc{ 0 };
+            auto write_piece = [&](size_t request, uint64_t offset, std::span<const unsigned char> data) {
+                size_t file = request_file[request];
+                if (offset == 0) {
+                    copy_reused(file);
+                    skip_padding();
+                    crc = 0;
+                }
+                file_io::write_all(hGFS, data);
+                position += data.size();
+                if (compare_hashes) {
+                    crc = checksum::crc32c(data, crc);
+                }
+                if (offset + data.size() == files[file].size) {
+                    if (compare_hashes) {
+                        crcs[file] = crc;
+                    }
+                    next_file = file + 1;
+                }
+            };
+            if (queue_depth > 0) {
+                file_io::read_in_order_overlapped(requests, queue_depth, write_piece);
+            }
+            else {
+                file_io::read_in_order(requests, jobs, write_piece);
+            }
+            copy_reused(files.size());
+        }
+        else {
+            for (const auto& file : files) {
+                skip_padding();
+                HANDLE CurrentFile = CreateFile(
+                    file.full_path.c_str(),
+                    GENERIC_READ,
+                    FILE_SHARE_READ,
+                    NULL,
+                    OPEN_EXISTING,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                    NULL
+                );
+                if (CurrentFile == INVALID_HANDLE_VALUE) {
+                    throw std::runtime_error("Failed to open file to pack: " + file.full_path.string());
+                }
+                try {
+                    file_io::copy_range(CurrentFile, 0, hGFS, file.size);
+                }
+                catch (...) {
+                    CloseHandle(CurrentFile);
+                    throw;
+                }
+                CloseHandle(CurrentFile);
+                position += file.size;
+            }
+        }
+        if (!SetEndOfFile(hGFS)) {
+            throw std::runtime_error("Failed to set end of file: " + output_path.string());
         }
     }
+    catch (...) {
+        CloseHandle(hGFS);
+        fs::remove(output_path);
+        throw;
+    }
+    CloseHandle(hGFS);
 
-    // Finalize header
-    _fseeki64(fGFS, (__int64)(0), SEEK_SET);
-    uint32_t be_offset_to_filedata = compat::byteswap(uint32_t(offset_to_filedata));
-    uint64_t be_numbers_of_file = compat::byteswap(uint64_t(files.size()));
+    phase.next("pack.finish");
+    if (previous) {
+        previous.reset();
+        fs::remove(pathGFS);
+        fs::rename(output_path, pathGFS);
+    }
 
-    std::fwrite(&be_offset_to_filedata, 0x4, 1, fGFS);
-    std::fwrite(&file_identifier_length, 0x8, 1, fGFS);
-    std::fwrite(file_identifier, 20, 1, fGFS);
-    std::fwrite(&file_version_length, 0x8, 1, fGFS);
-    std::fwrite(file_version, 0x3, 1, fGFS);
-    std::fwrite(&be_numbers_of_file, 0x8, 1, fGFS);
+    if (incremental) {
+        std::ofstream manifest(manifest_path(pathGFS), std::ios::binary | std::ios::trunc);
+        manifest << MANIFEST_MAGIC << ' ' << fs::file_size(pathGFS) << ' ' << write_time(pathGFS) << '\n';
+        for (size_t i = 0; i < files.size(); ++i) {
+            manifest << files[i].size << ' ' << files[i].mtime << ' ';
+            if (crcs[i]) {
+                manifest << std::hex << *crcs[i] << std::dec;
+            }
+            else {
+                manifest << '-';
+            }
+            manifest << ' ' << files[i].relative_path << '\n';
+        }
+        if (!manifest) {
+            throw std::runtime_error("Failed to write manifest: " + manifest_path(pathGFS).string());
+        }
+    }
+}
+
+// First entry of a patch archive: "GFS-PATCH 2 <base table crc>", a line with
+// the target indices of the shipped entries, then one removed path per line.
+// The second entry is the target's header and file table as is, so the
+// applied archive gets the target's layout and the next patch fits it.
+const std::string PATCH_ENTRY = ".gfspatch";
+const std::string PATCH_TABLE_ENTRY = ".gfstable";
+const std::string PATCH_MAGIC = "GFS-PATCH 2";
+
+GFSPatch::Summary GFSPatch::diff(const fs::path& base_path, const fs::path& target_path, const fs::path& patch_path) const {
+    trace::scope phase("diff.open");
+    GFSView base(base_path);
+    GFSView target(target_path);
+    const auto& target_entries = target.entries();
+
+    phase.next("diff.match");
+    Summary summary;
+    // Like a front to back search, the first entry of a duplicated path wins
+    std::unordered_map<std::string_view, const GFSView::Entry*> base_entries;
+    base_entries.reserve(base.entries().size());
+    for (const auto& entry : base.entries()) {
+        base_entries.emplace(entry.relative_path, &entry);
+    }
+    // Every target entry is either shipped or found under its path in the
+    // base, later copies of a duplicated path too. The summary counts paths.
+    std::unordered_set<std::string_view> target_paths;
+    target_paths.reserve(target_entries.size());
+    std::vector<char> first_copy(target_entries.size(), 0);
+    std::vector<char> shipped(target_entries.size(), 0);
+    std::vector<std::pair<const GFSView::Entry*, size_t>> same_size; // base entry, target index
+    for (size_t t = 0; t < target_entries.size(); ++t) {
+        const auto& entry = target_entries[t];
+        first_copy[t] = target_paths.insert(entry.relative_path).second;
+        auto base_it = base_entries.find(entry.relative_path);
+        if (base_it == base_entries.end()) {
+            shipped[t] = 1;
+            summary.added += first_copy[t];
+        }
+        else if (base_it->second->data_length != entry.data_length) {
+            shipped[t] = 1;
+            summary.changed += first_copy[t];
+        }
+        else if (entry.data_length > 0) {
+            same_size.push_back({ base_it->second, t });
+        }
+        else {
+            summary.unchanged += first_copy[t];
+        }
+    }
+
+    // Only entries of equal size need their contents compared. Both archives
+    // are mapped, so the bytes are compared directly, in COPY_CHUNK_SIZE
+    // pieces spread over the threads so a few big entries still split up.
+    phase.next("diff.compare");
+    std::vector<std::pair<size_t, uint64_t>> pieces; // same_size index, offset
+    for (size_t c = 0; c < same_size.size(); ++c) {
+        for (uint64_t offset = 0; offset < same_size[c].first->data_length; offset += file_io::COPY_CHUNK_SIZE) {
+            pieces.push_back({ c, offset });
+        }
+    }
+    std::vector<std::atomic<bool>> differs(same_size.size());
+    std::atomic<size_t> next_piece{ 0 };
+    auto compare = [&] {
+        for (;;) {
+            size_t p = next_piece.fetch_add(1);
+            if (p >= pieces.size()) return;
+            auto [c, offset] = pieces[p];
+            if (differs[c].load(std::memory_order_relaxed)) continue;
+            const GFSView::Entry& base_entry = *same_size[c].first;
+            const GFSView::Entry& target_entry = target_entries[same_size[c].second];
+            size_t length = (size_t)std::min<uint64_t>(base_entry.data_length - offset, file_io::COPY_CHUNK_SIZE);
+            if (std::memcmp(base.data(base_entry).data() + offset, target.data(target_entry).data() + offset, length) != 0) {
+                differs[c].store(true, std::memory_order_relaxed);
+            }
+        }
+    };
+    unsigned threads = jobs == 0 ? std::max(1u, std::thread::hardware_concurrency()) : jobs;
+    threads = (unsigned)std::min<size_t>(threads, std::max<size_t>(pieces.size(), 1));
+    std::vector<std::thread> workers;
+    for (unsigned w = 1; w < threads; ++w) {
+        workers.emplace_back(compare);
+    }
+    compare();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (size_t c = 0; c < same_size.size(); ++c) {
+        size_t t = same_size[c].second;
+        if (differs[c]) {
+            shipped[t] = 1;
+            summary.changed += first_copy[t];
+        }
+        else {
+            summary.unchanged += first_copy[t];
+        }
+    }
+
+    std::string manifest = PATCH_MAGIC + " ";
+    {
+        std::ostringstream crc;
+        crc << std::hex << checksum::crc32c(base.metadata());
+        manifest += crc.str() + "\n";
+    }
+    for (size_t t = 0; t < target_entries.size(); ++t) {
+        if (shipped[t]) {
+            manifest += std::to_string(t) + ' ';
+        }
+    }
+    manifest += '\n';
+    for (const auto& entry : base.entries()) {
+        if (base_entries[entry.relative_path] == &entry && target_paths.count(entry.relative_path) == 0) {
+            manifest.append(entry.relative_path);
+            manifest += '\n';
+            ++summary.removed;
+        }
+    }
+
+    // The patch itself: the manifest and the target's table, then the
+    // shipped entries in target order with their alignment
+    phase.next("diff.write");
+    auto target_table = target.metadata();
+    std::vector<unsigned char> meta_buffer;
+    uint64_t count = 2;
+    uint64_t records_size = 8 + PATCH_ENTRY.size() + 8 + 4 + 8 + PATCH_TABLE_ENTRY.size() + 8 + 4;
+    for (size_t t = 0; t < target_entries.size(); ++t) {
+        if (!shipped[t]) continue;
+        ++count;
+        records_size += 8 + target_entries[t].relative_path.size() + 8 + 4;
+    }
+    if (HEADER_SIZE + records_size > UINT32_MAX) {
+        throw std::runtime_error("Patch file table is too large: " + patch_path.string());
+    }
+    uint32_t data_offset = uint32_t(HEADER_SIZE + records_size);
+    meta_buffer.reserve(data_offset);
+    append_byteswapped(meta_buffer, data_offset);
+    append_byteswapped(meta_buffer, uint64_t(FILE_IDENTIFIER.size()));
+    meta_buffer.insert(meta_buffer.end(), FILE_IDENTIFIER.begin(), FILE_IDENTIFIER.end());
+    append_byteswapped(meta_buffer, uint64_t(FILE_VERSION.size()));
+    meta_buffer.insert(meta_buffer.end(), FILE_VERSION.begin(), FILE_VERSION.end());
+    append_byteswapped(meta_buffer, count);
+    append_byteswapped(meta_buffer, uint64_t(PATCH_ENTRY.size()));
+    meta_buffer.insert(meta_buffer.end(), PATCH_ENTRY.begin(), PATCH_ENTRY.end());
+    append_byteswapped(meta_buffer, uint64_t(manifest.size()));
+    append_byteswapped(meta_buffer, uint32_t(1));
+    append_byteswapped(meta_buffer, uint64_t(PATCH_TABLE_ENTRY.size()));
+    meta_buffer.insert(meta_buffer.end(), PATCH_TABLE_ENTRY.begin(), PATCH_TABLE_ENTRY.end());
+    append_byteswapped(meta_buffer, uint64_t(target_table.size()));
+    append_byteswapped(meta_buffer, uint32_t(1));
+    for (size_t t = 0; t < target_entries.size(); ++t) {
+        if (!shipped[t]) continue;
+        const auto& entry = target_entries[t];
+        append_byteswapped(meta_buffer, uint64_t(entry.relative_path.size()));
+        meta_buffer.insert(meta_buffer.end(), entry.relative_path.begin(), entry.relative_path.end());
+        append_byteswapped(meta_buffer, entry.data_length);
+        append_byteswapped(meta_buffer, entry.alignment);
+    }
 
-    std::fclose(fGFS);
+    HANDLE hPatch = CreateFile(
+        patch_path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+    if (hPatch == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Failed to create patch: " + patch_path.string());
+    }
+    try {
+        file_io::write_all(hPatch, meta_buffer);
+        file_io::write_all(hPatch, { (const unsigned char*)manifest.data(), manifest.size() });
+        file_io::write_all(hPatch, target_table);
+        uint64_t position = data_offset + manifest.size() + target_table.size();
+        for (size_t t = 0; t < target_entries.size(); ++t) {
+            if (!shipped[t]) continue;
+            const auto& entry = target_entries[t];
+            position = align_up(position, entry.alignment);
+            LARGE_INTEGER liPosition;
+            liPosition.QuadPart = position;
+            if (!SetFilePointerEx(hPatch, liPosition, NULL, FILE_BEGIN)) {
+                throw std::runtime_error("Failed to set file pointer: " + patch_path.string());
+            }
+            file_io::write_all(hPatch, target.data(entry));
+            position += entry.data_length;
+        }
+        // Padding in front of an empty last entry is never written, extend to it
+        LARGE_INTEGER liDataEnd;
+        liDataEnd.QuadPart = position;
+        if (!SetFilePointerEx(hPatch, liDataEnd, NULL, FILE_BEGIN) || !SetEndOfFile(hPatch)) {
+            throw std::runtime_error("Failed to set end of file: " + patch_path.string());
+        }
+    }
+    catch (...) {
+        CloseHandle(hPatch);
+        fs::remove(patch_path);
+        throw;
+    }
+    CloseHandle(hPatch);
+    return summary;
+}
+
+GFSPatch::Summary GFSPatch::apply(const fs::path& base_path, const fs::path& patch_path, const fs::path& output_path) const {
+    trace::scope phase("apply.open");
+    GFSView patch(patch_path);
+    const auto& patch_entries = patch.entries();
+    if (patch_entries.size() < 2 || patch_entries[0].relative_path != PATCH_ENTRY || patch_entries[1].relative_path != PATCH_TABLE_ENTRY) {
+        throw std::runtime_error("Not a patch archive: " + patch_path.string());
+    }
+    auto manifest_data = patch.data(patch_entries[0]);
+    std::istringstream manifest(std::string(manifest_data.begin(), manifest_data.end()));
+    std::string line;
+    std::getline(manifest, line);
+    std::istringstream header(line);
+    std::string magic, version, crc;
+    header >> magic >> version >> crc;
+    if (header.fail() || magic + " " + version != PATCH_MAGIC) {
+        throw std::runtime_error("Not a patch archive: " + patch_path.string());
+    }
+    // Unmapped before the result is moved over it
+    std::optional<GFSView> base;
+    base.emplace(base_path);
+    if (checksum::crc32c(base->metadata()) != (uint32_t)std::stoul(crc, nullptr, 16)) {
+        throw std::runtime_error("Patch does not fit the archive: " + base_path.string());
+    }
+
+    phase.next("apply.plan");
+    // The output takes the target's table as is, only the data comes from
+    // the base and the patch
+    auto table = patch.data(patch_entries[1]);
+    uint32_t data_offset = 0;
+    std::vector<GFSView::Entry> target_entries = GFSView::parse(table, UINT64_MAX, data_offset);
+    if (data_offset != table.size()) {
+        throw std::runtime_error("Patch is damaged: " + patch_path.string());
+    }
+    // Patch entry of every shipped target entry, 0 for the ones in the base
+    std::vector<size_t> shipped(target_entries.size(), 0);
+    std::getline(manifest, line);
+    {
+        std::istringstream indices(line);
+        size_t next_entry = 2;
+        size_t t;
+        while (indices >> t) {
+            if (t >= target_entries.size() || shipped[t] != 0 || next_entry == patch_entries.size() ||
+                patch_entries[next_entry].data_length != target_entries[t].data_length) {
+                throw std::runtime_error("Patch is damaged: " + patch_path.string());
+            }
+            shipped[t] = next_entry++;
+        }
+        if (next_entry != patch_entries.size()) {
+            throw std::runtime_error("Patch is damaged: " + patch_path.string());
+        }
+    }
+
+    Summary summary;
+    // Like a front to back search, the first entry of a duplicated path wins
+    std::unordered_map<std::string_view, const GFSView::Entry*> base_entries;
+    base_entries.reserve(base->entries().size());
+    for (const auto& entry : base->entries()) {
+        base_entries.emplace(entry.relative_path, &entry);
+    }
+    std::unordered_set<std::string_view> target_paths;
+    target_paths.reserve(target_entries.size());
+    std::vector<uint64_t> source_offset(target_entries.size());
+    for (size_t t = 0; t < target_entries.size(); ++t) {
+        const auto& entry = target_entries[t];
+        bool first_copy = target_paths.insert(entry.relative_path).second;
+        auto base_it = base_entries.find(entry.relative_path);
+        if (shipped[t] != 0) {
+            source_offset[t] = patch_entries[shipped[t]].data_offset;
+            (base_it == base_entries.end() ? summary.added : summary.changed) += first_copy;
+            continue;
+        }
+        if (base_it == base_entries.end() || base_it->second->data_length != entry.data_length) {
+            throw std::runtime_error("Patch does not fit the archive: " + base_path.string());
+        }
+        source_offset[t] = base_it->second->data_offset;
+        summary.unchanged += first_copy;
+    }
+    while (std::getline(manifest, line)) {
+        if (!line.empty()) ++summary.removed;
+    }
+
+    // The base may be the output, so the result is built next to it and
+    // moved over it at the end
+    phase.next("apply.write");
+    fs::path temp_path = output_path;
+    temp_path += ".tmp";
+    HANDLE hOutput = CreateFile(
+        temp_path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+    if (hOutput == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Failed to create archive: " + temp_path.string());
+    }
+    try {
+        file_io::write_all(hOutput, table);
+        const uint32_t cluster = file_io::block_clone_granularity(hOutput);
+        uint64_t data_end = data_offset;
+        // Neighbours from the same source that keep their spacing go out as one range
+        for (size_t t = 0; t < target_entries.size();) {
+            bool from_patch = shipped[t] != 0;
+            size_t run_end = t + 1;
+            while (run_end < target_entries.size() && (shipped[run_end] != 0) == from_patch &&
+                source_offset[run_end] - source_offset[t] == target_entries[run_end].data_offset - target_entries[t].data_offset) {
+                ++run_end;
+            }
+            const auto& last = target_entries[run_end - 1];
+            uint64_t length = last.data_offset + last.data_length - target_entries[t].data_offset;
+            file_io::clone_range(from_patch ? patch.handle() : base->handle(), source_offset[t],
+                hOutput, target_entries[t].data_offset, length, cluster);
+            data_end = target_entries[t].data_offset + length;
+            t = run_end;
+        }
+        // Padding in front of an empty last entry is never written, extend to it
+        LARGE_INTEGER liDataEnd;
+        liDataEnd.QuadPart = data_end;
+        if (!SetFilePointerEx(hOutput, liDataEnd, NULL, FILE_BEGIN) || !SetEndOfFile(hOutput)) {
+            throw std::runtime_error("Failed to set end of file: " + temp_path.string());
+        }
+    }
+    catch (...) {
+        CloseHandle(hOutput);
+        fs::remove(temp_path);
+        throw;
+    }
+    CloseHandle(hOutput);
+    base.reset();
+    fs::rename(temp_path, output_path);
+    return summary;
 }
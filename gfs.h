@@ -5,6 +5,7 @@
 #include <vector>
 #include <cstdint>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include <thread>
 #include <future>
@@ -12,39 +13,48 @@
 #include <windows.h>
 #include <type_traits>
 #include <cstdlib>
+#include <algorithm>
 #include <intrin.h>
+#include <span>
+#include <string_view>
+#include <cstring>
+#include "file_io.h"
+#include "byte_order.h"
 
-#if defined(_MSVC_LANG) && _MSVC_LANG >= 202302L
-#include <bit>
-#endif
+namespace fs = std::filesystem;
 
-namespace compat {
-#if defined(_MSVC_LANG) && _MSVC_LANG >= 202302L
-    using std::byteswap;
-#else
-    template <typename T>
-    inline T byteswap(T value) noexcept {
-        static_assert(std::is_integral_v<T>, "byteswap requires an integral type.");
-        if constexpr (sizeof(T) == 1) {
-            return value;
-        }
-        else if constexpr (sizeof(T) == 2) {
-            return static_cast<T>(_byteswap_ushort(static_cast<unsigned short>(value)));
-        }
-        else if constexpr (sizeof(T) == 4) {
-            return static_cast<T>(_byteswap_ulong(static_cast<unsigned long>(value)));
-        }
-        else if constexpr (sizeof(T) == 8) {
-            return static_cast<T>(_byteswap_uint64(static_cast<unsigned __int64>(value)));
-        }
-        else {
-            return value;
-        }
-    }
-#endif
-}
+// Read-only view of a whole archive. The file is mapped once and entries are
+// handed out as spans into the mapping, nothing is copied on the way out.
+class GFSView {
+public:
+    struct Entry {
+        std::string_view relative_path;
+        uint64_t data_length;
+        uint64_t data_offset; // absolute offset in the archive
+        uint32_t alignment;
+    };
+    GFSView(const fs::path path);
+    explicit GFSView(HANDLE file);
 
-namespace fs = std::filesystem;
+    uint32_t data_offset() const { return m_data_offset; }
+    uint64_t count_of_files() const { return m_entries.size(); }
+    HANDLE handle() const { return m_file.handle(); }
+    const std::vector<Entry>& entries() const { return m_entries; }
+    // Header and file table, everything in front of the first entry
+    std::span<const unsigned char> metadata() const { return m_file.bytes(0, m_data_offset); }
+    std::span<const unsigned char> data(const Entry& entry) const;
+    void extract(const Entry& entry, const fs::path& output_path) const;
+    // Parses the header and file table at the start of `archive` (at least
+    // its first data_offset bytes) of an archive of archive_size bytes. The
+    // entries point into `archive`.
+    static std::vector<Entry> parse(std::span<const unsigned char> archive, uint64_t archive_size, uint32_t& data_offset);
+private:
+    void _read();
+private:
+    file_io::mapped_file m_file;
+    uint32_t m_data_offset{ 0 };
+    std::vector<Entry> m_entries;
+};
 
 class GFSEdit {
 public:
@@ -55,55 +65,208 @@ public:
 
     void print_header();
     void print_file_metadata(size_t idx);
+    size_t count_of_files() const { return files_meta_data.size(); }
+    bool contains(const std::string& relative_path_in_archive) const { return meta_index.count(relative_path_in_archive) != 0; }
     void add_file(const fs::path& file_path, const std::string& relative_path_in_archive, bool replace_existing = false);
     void add_files(const fs::path& files_path, const std::string& relative_path_in_archive = "", bool replace_existing = false);
+    // Like add_file, with the data taken from `length` bytes of source_path at
+    // `offset` (an entry of another archive). alignment 0 keeps the alignment
+    // add_file would pick.
+    void add_file_range(const fs::path& source_path, uint64_t offset, uint64_t length,
+        const std::string& relative_path_in_archive, uint32_t file_alignment = 0, bool replace_existing = false);
+    // Drops the entry (and any pending change) for the path on the next commit
+    void remove_file(const std::string& relative_path_in_archive);
     void extract_file(const std::string& relative_path_in_archive, const fs::path& output_path);
-    void extract_files(const fs::path& output_path, const std::string& relative_path_in_archive = "");
-    void commit_changes();
+    void extract_files(const fs::path& output_path, const std::string& relative_path_in_archive = "", unsigned jobs = 1);
+    // Writes the pending changes. When allowed and the archive has enough slack
+    // after its metadata table, new entries are appended in place instead of
+    // rewriting the whole archive.
+    void commit_changes(bool allow_in_place = true);
+    // Writes the archive with the pending changes to output_path and leaves
+    // the original untouched. The editor then works on output_path.
+    void commit_as(const fs::path& output_path);
+    // Spare bytes kept after the metadata table by full rewrites (defaults to
+    // the slack the archive was opened with)
+    void set_metadata_reserve(uint32_t reserve) { metadata_reserve = reserve; }
+    // Alignment given to added entries. With realign_existing every entry gets
+    // it and the next commit rewrites the archive with the new layout.
+    void set_alignment(uint32_t new_alignment, bool realign_existing = false);
 private:
+    static const uint64_t WHOLE_FILE = UINT64_MAX;
     struct PendingChange {
         std::string relative_path;
         fs::path source_path;
         bool is_new;
+        uint32_t alignment;
+        uint64_t source_offset{ 0 };
+        uint64_t source_length{ WHOLE_FILE }; // the file's size at commit time
     };
     struct Header {
         uint32_t data_offset;
         uint64_t count_of_files;
+        uint64_t metadata_end;
     };
-    struct FileMetaData {
-        std::string relative_path;
-        uint64_t data_length;
-        uint64_t data_offset;
-        FileMetaData(const std::string& path, uint64_t length, uint64_t offset)
-            : relative_path(path), data_length(length), data_offset(offset) {
+    // File table as parallel arrays, the paths back to back in one arena.
+    // Views into the arena (the index keys below) go stale on every change.
+    struct MetaTable {
+        std::vector<uint64_t> data_length;
+        std::vector<uint64_t> data_offset; // relative to header.data_offset
+        std::vector<uint32_t> alignment;
+        std::vector<size_t> path_end; // path i is path_arena[path_end[i - 1], path_end[i])
+        std::string path_arena;
+
+        size_t size() const { return data_offset.size(); }
+        bool empty() const { return data_offset.empty(); }
+        std::string_view path(size_t idx) const {
+            size_t begin = idx == 0 ? 0 : path_end[idx - 1];
+            return std::string_view(path_arena).substr(begin, path_end[idx] - begin);
+        }
+        void reserve(size_t count, size_t path_bytes) {
+            data_length.reserve(count);
+            data_offset.reserve(count);
+            alignment.reserve(count);
+            path_end.reserve(count);
+            path_arena.reserve(path_bytes);
+        }
+        void push_back(std::string_view path, uint64_t length, uint64_t offset, uint32_t file_alignment) {
+            path_arena.append(path);
+            path_end.push_back(path_arena.size());
+            data_length.push_back(length);
+            data_offset.push_back(offset);
+            alignment.push_back(file_alignment);
+        }
+        // Drops the entries for which remove(idx) is true, keeping the order
+        template<typename F>
+        void erase_if(F remove) {
+            std::vector<char> removed(size());
+            for (size_t i = 0; i < size(); ++i) {
+                removed[i] = remove(i) ? 1 : 0;
+            }
+            size_t kept = 0;
+            size_t arena_end = 0;
+            size_t path_begin = 0;
+            for (size_t i = 0; i < size(); ++i) {
+                size_t old_end = path_end[i];
+                if (removed[i]) {
+                    path_begin = old_end;
+                    continue;
+                }
+                std::memmove(path_arena.data() + arena_end, path_arena.data() + path_begin, old_end - path_begin);
+                arena_end += old_end - path_begin;
+                path_begin = old_end;
+                data_length[kept] = data_length[i];
+                data_offset[kept] = data_offset[i];
+                alignment[kept] = alignment[i];
+                path_end[kept] = arena_end;
+                ++kept;
+            }
+            data_length.resize(kept);
+            data_offset.resize(kept);
+            alignment.resize(kept);
+            path_end.resize(kept);
+            path_arena.resize(arena_end);
         }
     };
+    void _build_index();
+    void _add_change(PendingChange change, bool replace_existing);
+    static uint64_t _change_size(const PendingChange& change);
+    bool _commit_in_place();
+    void _commit_rewrite(const fs::path& output_path);
     HANDLE hFile;
+    file_io::mapped_file archive_map;
     Header header{ NULL };
-    std::vector<FileMetaData> files_meta_data;
+    MetaTable files_meta_data;
     std::vector<PendingChange> pending_changes;
+    // Lookups by path, rebuilt on open and after every commit
+    std::unordered_map<std::string_view, size_t> meta_index;
+    // Probed with views into the arena as well, without a string per lookup
+    struct path_hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view path) const { return std::hash<std::string_view>{}(path); }
+    };
+    std::unordered_map<std::string, size_t, path_hash, std::equal_to<>> pending_index;
+    std::unordered_set<std::string, path_hash, std::equal_to<>> pending_removals;
+    // Indices of files_meta_data sorted by path, for directory (prefix) lookups
+    std::vector<size_t> sorted_meta;
+    bool has_duplicate_paths{ false };
+    uint32_t metadata_reserve{ 0 };
+    uint32_t alignment{ 1 };
+    bool layout_changed{ false };
     fs::path gfs_path;
 };
 
 class GFSUnpacker {
 private:
-    struct MetaInfo
-    {
-        unsigned __int64 File_Path_Lenght;
-        std::vector<char> File_Path;
-        unsigned __int64 File_Lenght;
-    };
+    unsigned jobs;
+    unsigned queue_depth;
 public:
+    // jobs: number of writer threads, 0 picks the hardware concurrency
+    // queue_depth: when not 0, files are written with overlapped I/O from one
+    // thread with up to this many writes queued instead (many small files)
+    GFSUnpacker(unsigned jobs = 1, unsigned queue_depth = 0) : jobs(jobs), queue_depth(queue_depth) {}
     void operator()(const std::filesystem::path& filetounpackcs);
+    // Rough peak memory of unpacking (or editing) the archive, for batch
+    // scheduling. File data is mapped, so only the file table counts.
+    static uint64_t memory_estimate(const std::filesystem::path& archive);
 };
 
 class GFSPacker {
 private:
-    __int64 file_identifier_length = compat::byteswap(uint64_t(20));
+    __int64 file_identifier_length = byte_order::byteswap(uint64_t(20));
     char file_identifier[20]{ 'R', 'e', 'v', 'e' ,'r' , 'g', 'e', ' ', 'P', 'a', 'c', 'k', 'a', 'g', 'e', ' ', 'F', 'i', 'l', 'e' }; //Reverge Package File
-    __int64 file_version_length = compat::byteswap(uint64_t(3));
+    __int64 file_version_length = byte_order::byteswap(uint64_t(3));
     char file_version[3]{ '1', '.', '1' }; //Reverge Package File
-    unsigned int file_aligned = compat::byteswap(uint32_t(0x1));
+    unsigned int file_aligned;
+    uint32_t alignment;
+    uint32_t metadata_reserve;
+    unsigned jobs;
+    bool incremental;
+    bool compare_hashes;
+    unsigned queue_depth;
 public:
+    // metadata_reserve: zero bytes left after the metadata table so GFSEdit
+    // can later add entries without rewriting the archive
+    // alignment: every file starts at a multiple of it (1 packs them tightly)
+    // jobs: reader threads feeding the writer, 1 packs on a single thread and
+    // 0 picks the hardware concurrency
+    // incremental: keep a manifest next to the archive and copy files whose
+    // size and write time did not change out of the previous archive
+    // compare_hashes: decide by size and CRC-32C instead of write time
+    // queue_depth: when not 0, files are read with overlapped I/O with up to
+    // this many reads queued instead of by reader threads
+    GFSPacker(uint32_t metadata_reserve = 0, uint32_t alignment = 1, unsigned jobs = 1,
+        bool incremental = false, bool compare_hashes = false, unsigned queue_depth = 0)
+        : file_aligned(byte_order::byteswap(uint32_t(std::max(alignment, 1u)))),
+        alignment(std::max(alignment, 1u)),
+        metadata_reserve(metadata_reserve),
+        jobs(jobs == 0 ? std::max(1u, std::thread::hardware_concurrency()) : jobs),
+        incremental(incremental || compare_hashes),
+        compare_hashes(compare_hashes),
+        queue_depth(queue_depth) {}
     void operator()(const std::filesystem::path& filestopackcs);
+    // Rough peak memory of the read buffers used while packing, for batch scheduling
+    uint64_t memory_estimate() const;
+};
+
+// Patches between two versions of an archive. A patch is a GFS archive of
+// the added and changed entries, led by a ".gfspatch" entry that names the
+// base archive it fits (CRC-32C of its file table) and lists removed paths.
+class GFSPatch {
+private:
+    unsigned jobs;
+public:
+    struct Summary {
+        size_t added{ 0 };
+        size_t changed{ 0 };
+        size_t removed{ 0 };
+        size_t unchanged{ 0 };
+    };
+    // jobs: threads comparing entries of equal size, 0 picks the hardware concurrency
+    GFSPatch(unsigned jobs = 1) : jobs(jobs) {}
+    Summary diff(const fs::path& base_path, const fs::path& target_path, const fs::path& patch_path) const;
+    // Rebuilds the target into output_path (which may be base_path). The patch
+    // carries the target's file table, so the result has the target's layout
+    // and a patch diffed against the target fits it. Unchanged entries are
+    // copied out of the base in runs.
+    Summary apply(const fs::path& base_path, const fs::path& patch_path, const fs::path& output_path) const;
 };
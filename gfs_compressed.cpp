@@ -0,0 +1,368 @@
+#include "gfs_compressed.h"
+#include "checksum.h"
+#include "trace.h"
+#include <compressapi.h>
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace gfs_compressed {
+    namespace {
+        const char CONTAINER_MAGIC[8]{ 'G', 'F', 'S', 'Z', 0, 0, 0, 1 };
+
+        struct ContainerHeader {
+            char magic[8];
+            uint32_t codec;
+            uint32_t frame_size;
+            uint64_t archive_size;
+            uint64_t frame_count;
+            uint64_t index_offset; // frame_count FrameRecords behind the frames
+        };
+        struct FrameRecord {
+            uint64_t offset;
+            uint32_t stored_size; // the frame's own size means it is stored uncompressed
+            uint32_t crc;         // CRC-32C of the uncompressed frame
+        };
+        static_assert(sizeof(ContainerHeader) == 40);
+        static_assert(sizeof(FrameRecord) == 16);
+        static_assert((uint32_t)codec::xpress_huff == COMPRESS_ALGORITHM_XPRESS_HUFF);
+        static_assert((uint32_t)codec::lzms == COMPRESS_ALGORITHM_LZMS);
+
+        // Compression API handles must not be shared between threads
+        class compressor {
+        public:
+            explicit compressor(uint32_t algorithm) {
+                if (!CreateCompressor(algorithm, NULL, &m_handle)) {
+                    throw std::runtime_error("Failed to create compressor");
+                }
+            }
+            ~compressor() { CloseCompressor(m_handle); }
+            compressor(const compressor&) = delete;
+            compressor& operator=(const compressor&) = delete;
+            // Compressed size, 0 when the data does not fit into `out`
+            size_t compress(std::span<const unsigned char> data, std::span<unsigned char> out) {
+                SIZE_T compressed = 0;
+                if (!Compress(m_handle, data.data(), data.size(), out.data(), out.size(), &compressed)) {
+                    if (GetLastError() == ERROR_INSUFFICIENT_BUFFER) return 0;
+                    throw std::runtime_error("Failed to compress frame");
+                }
+                return compressed;
+            }
+        private:
+            COMPRESSOR_HANDLE m_handle{ NULL };
+        };
+
+        class decompressor {
+        public:
+            explicit decompressor(uint32_t algorithm) {
+                if (!CreateDecompressor(algorithm, NULL, &m_handle)) {
+                    throw std::runtime_error("Failed to create decompressor");
+                }
+            }
+            ~decompressor() { CloseDecompressor(m_handle); }
+            decompressor(const decompressor&) = delete;
+            decompressor& operator=(const decompressor&) = delete;
+            void decompress(std::span<const unsigned char> data, std::span<unsigned char> out) {
+                SIZE_T decompressed = 0;
+                if (!Decompress(m_handle, data.data(), data.size(), out.data(), out.size(), &decompressed) ||
+                    decompressed != out.size()) {
+                    throw std::runtime_error("Failed to decompress frame");
+                }
+            }
+        private:
+            DECOMPRESSOR_HANDLE m_handle{ NULL };
+        };
+
+        uint32_t frame_length(const ContainerHeader& header, uint64_t frame) {
+            return (uint32_t)std::min<uint64_t>(header.frame_size, header.archive_size - frame * header.frame_size);
+        }
+
+        // Loads header and frame index, checking that everything lies inside the file
+        const FrameRecord* read_index(const file_io::mapped_file& file, ContainerHeader& header, const fs::path& path) {
+            if (file.size() < sizeof(header)) {
+                throw std::runtime_error("Not a compressed archive: " + path.string());
+            }
+            std::memcpy(&header, file.data(), sizeof(header));
+            if (std::memcmp(header.magic, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC)) != 0) {
+                throw std::runtime_error("Not a compressed archive: " + path.string());
+            }
+            if (header.frame_size == 0 ||
+                header.frame_count != (header.archive_size + header.frame_size - 1) / header.frame_size ||
+                header.index_offset > file.size() ||
+                header.frame_count > (file.size() - header.index_offset) / sizeof(FrameRecord)) {
+                throw std::runtime_error("Compressed archive is damaged: " + path.string());
+            }
+            const FrameRecord* index = (const FrameRecord*)(file.data() + header.index_offset);
+            for (uint64_t i = 0; i < header.frame_count; ++i) {
+                if (index[i].stored_size > frame_length(header, i) ||
+                    index[i].offset > file.size() || index[i].stored_size > file.size() - index[i].offset) {
+                    throw std::runtime_error("Compressed archive is damaged: " + path.string());
+                }
+            }
+            return index;
+        }
+
+        // Uncompressed bytes of one frame into `out` (sized to the frame)
+        void load_frame(decompressor& codec, const file_io::mapped_file& file, const FrameRecord& record,
+            std::span<unsigned char> out) {
+            auto stored = file.bytes(record.offset, record.stored_size);
+            if (record.stored_size == out.size()) {
+                std::memcpy(out.data(), stored.data(), out.size());
+            }
+            else {
+                codec.decompress(stored, out);
+            }
+            if (checksum::crc32c(out) != record.crc) {
+                throw std::runtime_error("Checksum mismatch in frame");
+            }
+        }
+
+        // Runs work(frame, state) for every frame on `jobs` threads, each with
+        // its own state. Frames are handed out in order and write(frame, state)
+        // is called strictly in frame order, one thread at a time. The first
+        // error stops all threads and is rethrown.
+        template<typename State, typename MakeState, typename Work, typename Write>
+        void run_frames(uint64_t frame_count, unsigned jobs, MakeState make_state, Work work, Write write) {
+            if (jobs == 0) {
+                jobs = std::max(1u, std::thread::hardware_concurrency());
+            }
+            jobs = (unsigned)std::min<uint64_t>(jobs, std::max<uint64_t>(frame_count, 1));
+            std::mutex mutex;
+            std::condition_variable written;
+            uint64_t next_write = 0;
+            bool failed = false;
+            std::exception_ptr error;
+            std::atomic<uint64_t> next_frame{ 0 };
+
+            auto worker = [&] {
+                try {
+                    State state = make_state();
+                    for (;;) {
+                        uint64_t frame = next_frame.fetch_add(1);
+                        if (frame >= frame_count) return;
+                        work(frame, state);
+                        // Frames are taken in order, so the lowest unwritten one never waits
+                        std::unique_lock lock(mutex);
+                        written.wait(lock, [&] { return failed || next_write == frame; });
+                        if (failed) return;
+                        write(frame, state);
+                        ++next_write;
+                        lock.unlock();
+                        written.notify_all();
+                    }
+                }
+                catch (...) {
+                    {
+                        std::lock_guard lock(mutex);
+                        if (!failed) error = std::current_exception();
+                        failed = true;
+                    }
+                    written.notify_all();
+                }
+            };
+            std::vector<std::thread> workers;
+            workers.reserve(jobs);
+            for (unsigned j = 0; j < jobs; ++j) {
+                workers.emplace_back(worker);
+            }
+            for (auto& thread : workers) {
+                thread.join();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    fs::path compress(const fs::path& archive_path, unsigned jobs, codec method, uint32_t frame_size) {
+        trace::scope phase("compress");
+        file_io::mapped_file archive(archive_path);
+        // Only real archives go in, so converting back can't produce garbage
+        uint32_t data_offset = 0;
+        GFSView::parse({ archive.data(), (size_t)archive.size() }, archive.size(), data_offset);
+
+        fs::path container_path = archive_path;
+        container_path.replace_extension(".gfsz");
+        fs::path temp_path = container_path;
+        temp_path += ".tmp";
+        ContainerHeader header{};
+        std::memcpy(header.magic, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+        header.codec = (uint32_t)method;
+        header.frame_size = std::max(frame_size, 1u);
+        header.archive_size = archive.size();
+        header.frame_count = (header.archive_size + header.frame_size - 1) / header.frame_size;
+
+        HANDLE hContainer = CreateFile(
+            temp_path.c_str(),
+            GENERIC_WRITE,
+            0,
+            NULL,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL
+        );
+        if (hContainer == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Failed to create compressed archive: " + temp_path.string());
+        }
+        try {
+            // The header goes out again once the index offset is known
+            file_io::write_all(hContainer, { (const unsigned char*)&header, sizeof(header) });
+            std::vector<FrameRecord> index((size_t)header.frame_count);
+            uint64_t position = sizeof(header);
+
+            struct state_t {
+                std::unique_ptr<compressor> codec;
+                std::vector<unsigned char> buffer;
+                std::span<const unsigned char> stored;
+                uint32_t crc;
+            };
+            run_frames<state_t>(header.frame_count, jobs,
+                [&] { return state_t{ std::make_unique<compressor>(header.codec), std::vector<unsigned char>(header.frame_size) }; },
+                [&](uint64_t frame, state_t& state) {
+                    auto raw = archive.bytes(frame * header.frame_size, frame_length(header, frame));
+                    state.crc = checksum::crc32c(raw);
+                    // Anything that doesn't shrink is kept as is
+                    size_t compressed = state.codec->compress(raw, { state.buffer.data(), raw.size() - 1 });
+                    state.stored = compressed == 0 ? raw : std::span<const unsigned char>(state.buffer.data(), compressed);
+                },
+                [&](uint64_t frame, state_t& state) {
+                    file_io::write_all(hContainer, state.stored);
+                    index[(size_t)frame] = { position, (uint32_t)state.stored.size(), state.crc };
+                    position += state.stored.size();
+                });
+
+            header.index_offset = position;
+            file_io::write_all(hContainer, { (const unsigned char*)index.data(), index.size() * sizeof(FrameRecord) });
+            LARGE_INTEGER liStart;
+            liStart.QuadPart = 0;
+            if (!SetFilePointerEx(hContainer, liStart, NULL, FILE_BEGIN)) {
+                throw std::runtime_error("Failed to set file pointer: " + container_path.string());
+            }
+            file_io::write_all(hContainer, { (const unsigned char*)&header, sizeof(header) });
+        }
+        catch (...) {
+            CloseHandle(hContainer);
+            fs::remove(temp_path);
+            throw;
+        }
+        CloseHandle(hContainer);
+        fs::rename(temp_path, container_path);
+        return container_path;
+    }
+
+    fs::path decompress(const fs::path& container_path, unsigned jobs) {
+        trace::scope phase("decompress");
+        file_io::mapped_file container(container_path);
+        ContainerHeader header;
+        const FrameRecord* index = read_index(container, header, container_path);
+
+        fs::path archive_path = container_path;
+        archive_path.replace_extension(".gfs");
+        // Often the archive the container was made from: it is only replaced
+        // once every frame is written
+        fs::path temp_path = archive_path;
+        temp_path += ".tmp";
+        HANDLE hGFS = CreateFile(
+            temp_path.c_str(),
+            GENERIC_WRITE,
+            0,
+            NULL,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL
+        );
+        if (hGFS == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Failed to create archive: " + temp_path.string());
+        }
+        try {
+            struct state_t {
+                std::unique_ptr<decompressor> codec;
+                std::vector<unsigned char> buffer;
+            };
+            run_frames<state_t>(header.frame_count, jobs,
+                [&] { return state_t{ std::make_unique<decompressor>(header.codec), std::vector<unsigned char>(header.frame_size) }; },
+                [&](uint64_t frame, state_t& state) {
+                    try {
+                        load_frame(*state.codec, container, index[frame], { state.buffer.data(), frame_length(header, frame) });
+                    }
+                    catch (const std::exception& e) {
+                        throw std::runtime_error(std::string(e.what()) + " " + std::to_string(frame) + ": " + container_path.string());
+                    }
+                },
+                [&](uint64_t frame, state_t& state) {
+                    file_io::write_all(hGFS, { state.buffer.data(), frame_length(header, frame) });
+                });
+        }
+        catch (...) {
+            CloseHandle(hGFS);
+            fs::remove(temp_path);
+            throw;
+        }
+        CloseHandle(hGFS);
+        fs::rename(temp_path, archive_path);
+        return archive_path;
+    }
+
+    reader::reader(const fs::path& container_path) : m_file(container_path) {
+        ContainerHeader header;
+        m_index = (const unsigned char*)read_index(m_file, header, container_path);
+        m_codec = header.codec;
+        m_frame_size = header.frame_size;
+        m_archive_size = header.archive_size;
+        m_frame_count = header.frame_count;
+
+        // The header tells how long the file table is
+        const uint64_t header_size = 0x33;
+        if (m_archive_size < header_size) {
+            throw std::runtime_error("Compressed archive is damaged: " + container_path.string());
+        }
+        auto start = read(0, 4);
+        uint32_t table_size = byte_order::load_be<uint32_t>(start.data());
+        m_metadata = read(0, std::clamp<uint64_t>(table_size, header_size, m_archive_size));
+        uint32_t data_offset = 0;
+        m_entries = GFSView::parse(m_metadata, m_archive_size, data_offset);
+    }
+
+    const GFSView::Entry* reader::find(std::string_view relative_path) const {
+        for (const auto& entry : m_entries) {
+            if (entry.relative_path == relative_path) return &entry;
+        }
+        return nullptr;
+    }
+
+    std::vector<unsigned char> reader::read(uint64_t offset, uint64_t length) const {
+        if (offset > m_archive_size || length > m_archive_size - offset) {
+            throw std::runtime_error("Read out of range of compressed archive");
+        }
+        std::vector<unsigned char> out((size_t)length);
+        if (length == 0) return out;
+        ContainerHeader header{};
+        header.frame_size = m_frame_size;
+        header.archive_size = m_archive_size;
+        decompressor codec(m_codec);
+        std::vector<unsigned char> frame_buffer(m_frame_size);
+        const FrameRecord* index = (const FrameRecord*)m_index;
+        for (uint64_t frame = offset / m_frame_size; frame * m_frame_size < offset + length; ++frame) {
+            uint64_t frame_start = frame * m_frame_size;
+            uint32_t frame_size = frame_length(header, frame);
+            load_frame(codec, m_file, index[frame], { frame_buffer.data(), frame_size });
+            uint64_t from = std::max(offset, frame_start);
+            uint64_t to = std::min(offset + length, frame_start + frame_size);
+            std::memcpy(out.data() + (from - offset), frame_buffer.data() + (from - frame_start), (size_t)(to - from));
+        }
+        return out;
+    }
+
+    void reader::extract(const GFSView::Entry& entry, const fs::path& output_path) const {
+        if (output_path.has_parent_path()) {
+            fs::create_directories(output_path.parent_path());
+        }
+        file_io::write_file(output_path, data(entry));
+    }
+}
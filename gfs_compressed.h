@@ -0,0 +1,54 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "gfs.h"
+
+namespace fs = std::filesystem;
+
+// Compressed cold storage for whole archives (".gfsz"). The archive is cut
+// into fixed size frames that are compressed independently with the Windows
+// Compression API, followed by an index of the frames. Converting back gives
+// the original archive byte for byte, and single entries can be read by
+// decompressing only the frames they cover.
+namespace gfs_compressed {
+    enum class codec : uint32_t {
+        xpress_huff = 4, // COMPRESS_ALGORITHM_XPRESS_HUFF: fast, decent ratio
+        lzms = 5,        // COMPRESS_ALGORITHM_LZMS: slow to compress, small
+    };
+    const uint32_t DEFAULT_FRAME_SIZE = 1024 * 1024;
+
+    // archive.gfs -> archive.gfsz, frames compressed on `jobs` threads (0
+    // picks the hardware concurrency). Returns the container's path.
+    fs::path compress(const fs::path& archive_path, unsigned jobs = 1, codec method = codec::xpress_huff,
+        uint32_t frame_size = DEFAULT_FRAME_SIZE);
+    // archive.gfsz -> archive.gfs, every frame checked against its CRC-32C.
+    // Returns the archive's path.
+    fs::path decompress(const fs::path& container_path, unsigned jobs = 1);
+
+    // Entries of a container, read without restoring the archive
+    class reader {
+    public:
+        explicit reader(const fs::path& container_path);
+
+        uint64_t archive_size() const { return m_archive_size; }
+        const std::vector<GFSView::Entry>& entries() const { return m_entries; }
+        // First entry stored under relative_path, nullptr if there is none
+        const GFSView::Entry* find(std::string_view relative_path) const;
+        // Decompresses `length` bytes of the archive starting at `offset`
+        std::vector<unsigned char> read(uint64_t offset, uint64_t length) const;
+        std::vector<unsigned char> data(const GFSView::Entry& entry) const { return read(entry.data_offset, entry.data_length); }
+        void extract(const GFSView::Entry& entry, const fs::path& output_path) const;
+    private:
+        file_io::mapped_file m_file;
+        uint32_t m_codec{ 0 };
+        uint32_t m_frame_size{ 0 };
+        uint64_t m_archive_size{ 0 };
+        uint64_t m_frame_count{ 0 };
+        const unsigned char* m_index{ nullptr };
+        std::vector<unsigned char> m_metadata; // header and file table, the entries point into it
+        std::vector<GFSView::Entry> m_entries;
+    };
+}
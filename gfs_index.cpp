@@ -0,0 +1,300 @@
+#include "gfs_index.h"
+#include "gfs.h"
+#include "checksum.h"
+#include <stdexcept>
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+
+namespace {
+    const char INDEX_MAGIC[8]{ 'G', 'F', 'S', 'I', 'D', 'X', 0, 1 };
+    // Every 16th path is stored whole so a lookup decodes at most 16 of them
+    const size_t RESTART_INTERVAL = 16;
+
+    struct IndexHeader {
+        char magic[8];
+        uint64_t archive_size;
+        int64_t archive_mtime;
+        uint32_t metadata_crc;
+        uint32_t reserved;
+        uint64_t count;
+        uint64_t bucket_count;   // power of two
+        uint64_t entries_offset; // count GFSIndex::Entry records, archive order
+        uint64_t buckets_offset; // bucket_count pairs of uint32_t
+        uint64_t sorted_offset;  // count uint32_t entry indices, path order
+        uint64_t restarts_offset; // one uint64_t string offset per restart
+        uint64_t strings_offset;
+        uint64_t strings_size;
+    };
+    static_assert(sizeof(IndexHeader) == 96);
+    static_assert(sizeof(GFSIndex::Entry) == 24);
+
+    uint64_t hash_path(std::string_view path) {
+        uint64_t hash = 0xCBF29CE484222325;
+        for (unsigned char c : path) {
+            hash = (hash ^ c) * 0x100000001B3;
+        }
+        return hash;
+    }
+
+    void append_varint(std::vector<unsigned char>& buffer, uint64_t value) {
+        while (value >= 0x80) {
+            buffer.push_back((unsigned char)(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back((unsigned char)value);
+    }
+
+    uint64_t read_varint(const unsigned char*& ptr, const unsigned char* end) {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (ptr == end) break;
+            unsigned char byte = *ptr++;
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        throw std::runtime_error("Index is damaged");
+    }
+
+    template<typename T>
+    void append_raw(std::vector<unsigned char>& buffer, const T* data, size_t count) {
+        buffer.insert(buffer.end(), (const unsigned char*)data, (const unsigned char*)(data + count));
+        buffer.resize((buffer.size() + 7) / 8 * 8);
+    }
+}
+
+fs::path GFSIndex::index_path(const fs::path& archive_path) {
+    fs::path path = archive_path;
+    return path.replace_extension(".gfsidx");
+}
+
+GFSIndex::GFSIndex(const fs::path& archive_path) : m_archive(archive_path) {
+    // The header and file table end where the data starts
+    if (m_archive.size() < 4) {
+        throw std::runtime_error("File is too small for a GFS header");
+    }
+    uint32_t data_offset = byte_order::load_be<uint32_t>(m_archive.data());
+    m_metadata_crc = checksum::crc32c(m_archive.bytes(0, std::min<uint64_t>(data_offset, m_archive.size())));
+    m_archive_mtime = (int64_t)fs::last_write_time(archive_path).time_since_epoch().count();
+
+    fs::path path = index_path(archive_path);
+    if (_open(path)) {
+        return;
+    }
+
+    std::vector<unsigned char> index = _build();
+    m_rebuilt = true;
+    try {
+        fs::path temp_path = path;
+        temp_path += ".tmp";
+        file_io::write_file(temp_path, index);
+        fs::rename(temp_path, path);
+        if (_open(path)) {
+            return;
+        }
+    }
+    catch (const std::exception&) {
+        // Read-only location, keep the index in memory for this run
+    }
+    m_memory = std::move(index);
+    if (!_attach(m_memory.data(), m_memory.size())) {
+        throw std::runtime_error("Failed to build index: " + path.string());
+    }
+}
+
+bool GFSIndex::_open(const fs::path& path) {
+    std::error_code ec;
+    if (!fs::exists(path, ec)) {
+        return false;
+    }
+    try {
+        m_file = file_io::mapped_file(path);
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    if (!_attach(m_file.data(), m_file.size())) {
+        m_file = file_io::mapped_file();
+        return false;
+    }
+    return true;
+}
+
+bool GFSIndex::_attach(const unsigned char* data, uint64_t size) {
+    if (size < sizeof(IndexHeader)) {
+        return false;
+    }
+    IndexHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+        header.archive_size != m_archive.size() ||
+        header.archive_mtime != m_archive_mtime ||
+        header.metadata_crc != m_metadata_crc) {
+        return false;
+    }
+    // Layout checks only, so a damaged file is rebuilt instead of read out of bounds
+    uint64_t restart_count = (header.count + RESTART_INTERVAL - 1) / RESTART_INTERVAL;
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t element) {
+        return offset % 8 == 0 && offset <= size && count <= (size - offset) / element;
+    };
+    if (header.count > UINT32_MAX || header.bucket_count == 0 ||
+        (header.bucket_count & (header.bucket_count - 1)) != 0 || header.bucket_count <= header.count ||
+        !fits(header.entries_offset, header.count, sizeof(Entry)) ||
+        !fits(header.buckets_offset, header.bucket_count, 8) ||
+        !fits(header.sorted_offset, header.count, 4) ||
+        !fits(header.restarts_offset, restart_count, 8) ||
+        !fits(header.strings_offset, header.strings_size, 1)) {
+        return false;
+    }
+    m_count = header.count;
+    m_bucket_mask = header.bucket_count - 1;
+    m_entries = (const Entry*)(data + header.entries_offset);
+    m_buckets = (const uint32_t*)(data + header.buckets_offset);
+    m_sorted = (const uint32_t*)(data + header.sorted_offset);
+    m_restarts = (const uint64_t*)(data + header.restarts_offset);
+    m_strings = data + header.strings_offset;
+    m_strings_size = header.strings_size;
+    return true;
+}
+
+std::vector<unsigned char> GFSIndex::_build() const {
+    GFSView archive(m_archive.handle());
+    const auto& entries = archive.entries();
+    if (entries.size() > UINT32_MAX) {
+        throw std::runtime_error("Too many files for an index");
+    }
+
+    std::vector<uint32_t> sorted(entries.size());
+    std::iota(sorted.begin(), sorted.end(), 0);
+    std::stable_sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b) {
+        return entries[a].relative_path < entries[b].relative_path;
+    });
+
+    std::vector<Entry> records(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        records[i] = { entries[i].data_offset, entries[i].data_length, entries[i].alignment, 0 };
+    }
+    std::vector<unsigned char> strings;
+    std::vector<uint64_t> restarts;
+    std::string_view previous;
+    for (uint32_t rank = 0; rank < sorted.size(); ++rank) {
+        std::string_view path = entries[sorted[rank]].relative_path;
+        records[sorted[rank]].rank = rank;
+        size_t shared = 0;
+        if (rank % RESTART_INTERVAL == 0) {
+            restarts.push_back(strings.size());
+        }
+        else {
+            size_t limit = std::min(previous.size(), path.size());
+            while (shared < limit && previous[shared] == path[shared]) {
+                ++shared;
+            }
+        }
+        append_varint(strings, shared);
+        append_varint(strings, path.size() - shared);
+        strings.insert(strings.end(), path.begin() + shared, path.end());
+        previous = path;
+    }
+
+    // Open addressing at a load factor of at most one half
+    uint64_t bucket_count = 1;
+    while (bucket_count < entries.size() * 2 + 1) {
+        bucket_count *= 2;
+    }
+    std::vector<uint32_t> buckets(bucket_count * 2, 0);
+    for (uint32_t i = 0; i < entries.size(); ++i) {
+        uint64_t hash = hash_path(entries[i].relative_path);
+        for (uint64_t slot = hash & (bucket_count - 1);; slot = (slot + 1) & (bucket_count - 1)) {
+            if (buckets[slot * 2] == 0) {
+                buckets[slot * 2] = i + 1;
+                buckets[slot * 2 + 1] = (uint32_t)(hash >> 32);
+                break;
+            }
+            if (entries[buckets[slot * 2] - 1].relative_path == entries[i].relative_path) {
+                break; // duplicate path, the earlier entry stays
+            }
+        }
+    }
+
+    IndexHeader header{};
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.archive_size = m_archive.size();
+    header.archive_mtime = m_archive_mtime;
+    header.metadata_crc = m_metadata_crc;
+    header.count = entries.size();
+    header.bucket_count = bucket_count;
+
+    std::vector<unsigned char> index;
+    index.reserve(sizeof(header) + records.size() * sizeof(Entry) + buckets.size() * 4 +
+        sorted.size() * 4 + restarts.size() * 8 + strings.size() + 32);
+    append_raw(index, &header, 1);
+    header.entries_offset = index.size();
+    append_raw(index, records.data(), records.size());
+    header.buckets_offset = index.size();
+    append_raw(index, buckets.data(), buckets.size());
+    header.sorted_offset = index.size();
+    append_raw(index, sorted.data(), sorted.size());
+    header.restarts_offset = index.size();
+    append_raw(index, restarts.data(), restarts.size());
+    header.strings_offset = index.size();
+    header.strings_size = strings.size();
+    append_raw(index, strings.data(), strings.size());
+    std::memcpy(index.data(), &header, sizeof(header));
+    return index;
+}
+
+std::string GFSIndex::path(size_t rank) const {
+    if (rank >= m_count) {
+        throw std::out_of_range("Index rank is out of range");
+    }
+    size_t first = rank / RESTART_INTERVAL * RESTART_INTERVAL;
+    if (m_restarts[first / RESTART_INTERVAL] > m_strings_size) {
+        throw std::runtime_error("Index is damaged");
+    }
+    const unsigned char* ptr = m_strings + m_restarts[first / RESTART_INTERVAL];
+    const unsigned char* end = m_strings + m_strings_size;
+    std::string path;
+    for (size_t i = first; i <= rank; ++i) {
+        uint64_t shared = read_varint(ptr, end);
+        uint64_t length = read_varint(ptr, end);
+        if (shared > path.size() || length > uint64_t(end - ptr)) {
+            throw std::runtime_error("Index is damaged");
+        }
+        path.resize((size_t)shared);
+        path.append((const char*)ptr, (size_t)length);
+        ptr += length;
+    }
+    return path;
+}
+
+const GFSIndex::Entry& GFSIndex::entry(size_t rank) const {
+    if (rank >= m_count || m_sorted[rank] >= m_count) {
+        throw std::out_of_range("Index rank is out of range");
+    }
+    return m_entries[m_sorted[rank]];
+}
+
+const GFSIndex::Entry* GFSIndex::find(std::string_view relative_path) const {
+    uint64_t hash = hash_path(relative_path);
+    for (uint64_t slot = hash & m_bucket_mask, probes = 0; probes <= m_bucket_mask; slot = (slot + 1) & m_bucket_mask, ++probes) {
+        uint32_t entry = m_buckets[slot * 2];
+        if (entry == 0 || entry > m_count) {
+            return nullptr;
+        }
+        if (m_buckets[slot * 2 + 1] == (uint32_t)(hash >> 32) && path(m_entries[entry - 1].rank) == relative_path) {
+            return &m_entries[entry - 1];
+        }
+    }
+    return nullptr;
+}
+
+std::span<const unsigned char> GFSIndex::data(const Entry& entry) const {
+    return m_archive.bytes(entry.data_offset, entry.data_length);
+}
+
+void GFSIndex::extract(const Entry& entry, const fs::path& output_path) const {
+    if (output_path.has_parent_path()) {
+        fs::create_directories(output_path.parent_path());
+    }
+    file_io::write_file(output_path, data(entry));
+}
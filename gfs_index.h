@@ -0,0 +1,64 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "file_io.h"
+
+namespace fs = std::filesystem;
+
+// Sidecar index "<archive>.gfsidx" for looking up single files without
+// parsing the archive's metadata. It is keyed to the archive's size, write
+// time and a CRC-32C of its header and file table, and rebuilt whenever one
+// of them no longer matches. The file is mapped as is: a hash table over the
+// paths, the entries, and the paths themselves front coded in sorted order.
+class GFSIndex {
+public:
+    struct Entry {
+        uint64_t data_offset; // absolute offset in the archive
+        uint64_t data_length;
+        uint32_t alignment;
+        uint32_t rank; // position in path order
+    };
+
+    // Opens the index next to archive_path, building it first when it is
+    // missing or stale. If it can't be written the index is kept in memory.
+    explicit GFSIndex(const fs::path& archive_path);
+
+    uint64_t count_of_files() const { return m_count; }
+    bool rebuilt() const { return m_rebuilt; }
+    // Entry stored under relative_path, nullptr if there is none. With
+    // duplicate paths the first one in the archive wins, as in GFSEdit.
+    const Entry* find(std::string_view relative_path) const;
+    // Path and entry at position `rank` of the sorted path list
+    std::string path(size_t rank) const;
+    const Entry& entry(size_t rank) const;
+
+    std::span<const unsigned char> data(const Entry& entry) const;
+    void extract(const Entry& entry, const fs::path& output_path) const;
+
+    static fs::path index_path(const fs::path& archive_path);
+private:
+    bool _open(const fs::path& path);
+    bool _attach(const unsigned char* data, uint64_t size);
+    std::vector<unsigned char> _build() const;
+private:
+    file_io::mapped_file m_archive;
+    uint32_t m_metadata_crc{ 0 };
+    int64_t m_archive_mtime{ 0 };
+
+    file_io::mapped_file m_file;
+    std::vector<unsigned char> m_memory; // used when the index file can't be written
+    bool m_rebuilt{ false };
+
+    uint64_t m_count{ 0 };
+    uint64_t m_bucket_mask{ 0 };
+    const Entry* m_entries{ nullptr };
+    const uint32_t* m_buckets{ nullptr }; // pairs of (entry index + 1, high hash bits)
+    const uint32_t* m_sorted{ nullptr };
+    const uint64_t* m_restarts{ nullptr };
+    const unsigned char* m_strings{ nullptr };
+    uint64_t m_strings_size{ 0 };
+};
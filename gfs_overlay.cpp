@@ -0,0 +1,168 @@
+#include "gfs_overlay.h"
+#include <stdexcept>
+
+namespace {
+    // Bloom filter shape: about 0.25% false positives
+    const uint64_t BLOOM_BITS_PER_PATH = 16;
+    const unsigned BLOOM_PROBES = 4;
+
+    uint64_t hash_path(std::string_view path) {
+        uint64_t hash = 0xCBF29CE484222325;
+        for (unsigned char c : path) {
+            hash = (hash ^ c) * 0x100000001B3;
+        }
+        return hash;
+    }
+}
+
+GFSOverlay::GFSOverlay(const std::vector<fs::path>& layers) {
+    if (layers.size() > UINT32_MAX) {
+        throw std::runtime_error("Too many overlay layers");
+    }
+    m_layers.reserve(layers.size());
+    size_t total = 0;
+    for (const auto& path : layers) {
+        m_layers.push_back({ path, GFSView(path), {}, {} });
+        Layer& layer = m_layers.back();
+        const auto& entries = layer.view.entries();
+        if (entries.size() >= UINT32_MAX) {
+            throw std::runtime_error("Too many files in overlay layer: " + path.string());
+        }
+        _init(layer.table, entries.size());
+        _init(layer.bloom, entries.size());
+        auto path_of = [&](uint32_t i) { return entries[i].relative_path; };
+        for (uint32_t i = 0; i < entries.size(); ++i) {
+            uint64_t hash = hash_path(entries[i].relative_path);
+            // Duplicate paths inside one archive: the first one wins, as in GFSEdit
+            _insert(layer.table, hash, i, path_of);
+            _add(layer.bloom, hash);
+        }
+        total += entries.size();
+    }
+
+    // Highest layer first, so the first entry seen for a path is the one served
+    _init(m_table, total);
+    m_entries.reserve(total);
+    auto path_of = [&](uint32_t i) { return m_entries[i].entry->relative_path; };
+    for (size_t l = m_layers.size(); l-- > 0;) {
+        const auto& entries = m_layers[l].view.entries();
+        for (const auto& entry : entries) {
+            m_entries.push_back({ &entry, (uint32_t)l });
+            if (!_insert(m_table, hash_path(entry.relative_path), (uint32_t)(m_entries.size() - 1), path_of)) {
+                m_entries.pop_back();
+            }
+        }
+    }
+    m_entries.shrink_to_fit();
+}
+
+const GFSOverlay::Entry* GFSOverlay::find(std::string_view relative_path) const {
+    uint64_t hash = hash_path(relative_path);
+    // Filters are far smaller than the table, so misses rarely touch it
+    bool maybe = false;
+    for (const auto& layer : m_layers) {
+        if (_may_contain(layer.bloom, hash)) {
+            maybe = true;
+            break;
+        }
+    }
+    if (!maybe) return nullptr;
+    uint32_t item = _find(m_table, hash, relative_path, [&](uint32_t i) { return m_entries[i].entry->relative_path; });
+    return item == 0 ? nullptr : &m_entries[item - 1];
+}
+
+const GFSView::Entry* GFSOverlay::find_in_layer(size_t layer, std::string_view relative_path) const {
+    const Layer& l = m_layers.at(layer);
+    uint64_t hash = hash_path(relative_path);
+    if (!_may_contain(l.bloom, hash)) return nullptr;
+    const auto& entries = l.view.entries();
+    uint32_t item = _find(l.table, hash, relative_path, [&](uint32_t i) { return entries[i].relative_path; });
+    return item == 0 ? nullptr : &entries[item - 1];
+}
+
+std::vector<uint32_t> GFSOverlay::layers_of(std::string_view relative_path) const {
+    std::vector<uint32_t> found;
+    uint64_t hash = hash_path(relative_path);
+    for (size_t l = m_layers.size(); l-- > 0;) {
+        const Layer& layer = m_layers[l];
+        if (!_may_contain(layer.bloom, hash)) continue;
+        const auto& entries = layer.view.entries();
+        if (_find(layer.table, hash, relative_path, [&](uint32_t i) { return entries[i].relative_path; }) != 0) {
+            found.push_back((uint32_t)l);
+        }
+    }
+    return found;
+}
+
+std::span<const unsigned char> GFSOverlay::data(const Entry& entry) const {
+    return m_layers.at(entry.layer).view.data(*entry.entry);
+}
+
+void GFSOverlay::extract(const Entry& entry, const fs::path& output_path) const {
+    if (output_path.has_parent_path()) {
+        fs::create_directories(output_path.parent_path());
+    }
+    file_io::write_file(output_path, data(entry));
+}
+
+void GFSOverlay::_init(PathTable& table, size_t count) {
+    uint64_t bucket_count = 1;
+    while (bucket_count < count * 2 + 1) {
+        bucket_count *= 2;
+    }
+    table.buckets.assign(bucket_count * 2, 0);
+    table.mask = bucket_count - 1;
+}
+
+template<typename PathOf>
+bool GFSOverlay::_insert(PathTable& table, uint64_t hash, uint32_t item, PathOf path_of) {
+    for (uint64_t slot = hash & table.mask;; slot = (slot + 1) & table.mask) {
+        uint32_t existing = table.buckets[slot * 2];
+        if (existing == 0) {
+            table.buckets[slot * 2] = item + 1;
+            table.buckets[slot * 2 + 1] = (uint32_t)(hash >> 32);
+            return true;
+        }
+        if (table.buckets[slot * 2 + 1] == (uint32_t)(hash >> 32) && path_of(existing - 1) == path_of(item)) {
+            return false;
+        }
+    }
+}
+
+template<typename PathOf>
+uint32_t GFSOverlay::_find(const PathTable& table, uint64_t hash, std::string_view path, PathOf path_of) {
+    for (uint64_t slot = hash & table.mask;; slot = (slot + 1) & table.mask) {
+        uint32_t item = table.buckets[slot * 2];
+        if (item == 0) return 0;
+        if (table.buckets[slot * 2 + 1] == (uint32_t)(hash >> 32) && path_of(item - 1) == path) {
+            return item;
+        }
+    }
+}
+
+void GFSOverlay::_init(Bloom& bloom, size_t count) {
+    uint64_t bit_count = 64;
+    while (bit_count < count * BLOOM_BITS_PER_PATH) {
+        bit_count *= 2;
+    }
+    bloom.bits.assign(bit_count / 64, 0);
+    bloom.mask = bit_count - 1;
+}
+
+// Probe positions come from the two halves of the path hash (double hashing)
+void GFSOverlay::_add(Bloom& bloom, uint64_t hash) {
+    uint64_t step = (hash >> 32) | 1;
+    for (unsigned i = 0; i < BLOOM_PROBES; ++i) {
+        uint64_t bit = (hash + i * step) & bloom.mask;
+        bloom.bits[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+}
+
+bool GFSOverlay::_may_contain(const Bloom& bloom, uint64_t hash) {
+    uint64_t step = (hash >> 32) | 1;
+    for (unsigned i = 0; i < BLOOM_PROBES; ++i) {
+        uint64_t bit = (hash + i * step) & bloom.mask;
+        if (!(bloom.bits[bit / 64] & (uint64_t(1) << (bit % 64)))) return false;
+    }
+    return true;
+}
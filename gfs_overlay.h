@@ -0,0 +1,71 @@
+#pragma once
+
+#include <filesystem>
+#include <span>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "gfs.h"
+
+namespace fs = std::filesystem;
+
+// Several archives mounted on top of each other the way the game resolves
+// them: base data first, then patches and mods, and a path is served by the
+// last archive that has it. Archives stay mapped and nothing is extracted.
+// One hash table over all distinct paths answers lookups, and every layer
+// keeps a bloom filter so per-layer queries skip layers without the path.
+class GFSOverlay {
+public:
+    struct Entry {
+        const GFSView::Entry* entry;
+        uint32_t layer;
+    };
+
+    // layers: archive paths, lowest priority first
+    explicit GFSOverlay(const std::vector<fs::path>& layers);
+
+    size_t layer_count() const { return m_layers.size(); }
+    const fs::path& layer_path(size_t layer) const { return m_layers.at(layer).path; }
+    const GFSView& layer(size_t layer) const { return m_layers.at(layer).view; }
+
+    // One entry per distinct path, taken from the highest layer that has it
+    uint64_t count_of_files() const { return m_entries.size(); }
+    const std::vector<Entry>& entries() const { return m_entries; }
+    // Entry the game would load for relative_path, nullptr if no layer has it
+    const Entry* find(std::string_view relative_path) const;
+    // Entry of relative_path in one layer only, shadowed or not
+    const GFSView::Entry* find_in_layer(size_t layer, std::string_view relative_path) const;
+    // Layers that have relative_path, highest priority first
+    std::vector<uint32_t> layers_of(std::string_view relative_path) const;
+
+    std::span<const unsigned char> data(const Entry& entry) const;
+    void extract(const Entry& entry, const fs::path& output_path) const;
+private:
+    // Open addressing at a load factor of at most one half, over item indices
+    struct PathTable {
+        std::vector<uint32_t> buckets; // pairs of (item + 1, high hash bits)
+        uint64_t mask{ 0 };
+    };
+    struct Bloom {
+        std::vector<uint64_t> bits;
+        uint64_t mask{ 0 }; // bit count - 1
+    };
+    struct Layer {
+        fs::path path;
+        GFSView view;
+        PathTable table;
+        Bloom bloom;
+    };
+    static void _init(PathTable& table, size_t count);
+    template<typename PathOf>
+    static bool _insert(PathTable& table, uint64_t hash, uint32_t item, PathOf path_of);
+    template<typename PathOf>
+    static uint32_t _find(const PathTable& table, uint64_t hash, std::string_view path, PathOf path_of);
+    static void _init(Bloom& bloom, size_t count);
+    static void _add(Bloom& bloom, uint64_t hash);
+    static bool _may_contain(const Bloom& bloom, uint64_t hash);
+private:
+    std::vector<Layer> m_layers;
+    std::vector<Entry> m_entries;
+    PathTable m_table;
+};
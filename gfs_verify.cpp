@@ -0,0 +1,190 @@
+#include "gfs_verify.h"
+#include "checksum.h"
+#include "trace.h"
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+    // "GFS-SUMS 1 <count>", then "<crc> <size> <path>" per entry in archive order
+    const std::string SUMS_MAGIC = "GFS-SUMS 1";
+
+    // Calls work(i) for every i below count on `jobs` threads, the calling one included
+    template<typename Work>
+    void parallel_for(size_t count, unsigned jobs, Work work) {
+        if (jobs == 0) {
+            jobs = std::max(1u, std::thread::hardware_concurrency());
+        }
+        jobs = (unsigned)std::min<size_t>(jobs, std::max<size_t>(count, 1));
+        std::atomic<size_t> next{ 0 };
+        auto worker = [&] {
+            for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+                work(i);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (unsigned j = 1; j < jobs; ++j) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : workers) {
+            thread.join();
+        }
+    }
+}
+
+fs::path GFSVerifier::sums_path(const fs::path& archive_path) {
+    fs::path path = archive_path;
+    return path += ".sums";
+}
+
+std::vector<uint32_t> GFSVerifier::checksums(const GFSView& archive) const {
+    trace::scope phase("verify.checksums");
+    const auto& entries = archive.entries();
+    struct piece_t {
+        size_t entry;
+        uint64_t offset;
+        uint64_t length;
+    };
+    std::vector<piece_t> pieces;
+    for (size_t e = 0; e < entries.size(); ++e) {
+        for (uint64_t offset = 0; offset < entries[e].data_length; offset += file_io::COPY_CHUNK_SIZE) {
+            pieces.push_back({ e, offset, std::min<uint64_t>(entries[e].data_length - offset, file_io::COPY_CHUNK_SIZE) });
+        }
+    }
+    std::vector<uint32_t> piece_crcs(pieces.size());
+    parallel_for(pieces.size(), jobs, [&](size_t p) {
+        piece_crcs[p] = checksum::crc32c(archive.data(entries[pieces[p].entry]).subspan((size_t)pieces[p].offset, (size_t)pieces[p].length));
+    });
+
+    // Pieces are in entry order, so every entry folds its own run together
+    std::vector<uint32_t> crcs(entries.size(), 0);
+    for (size_t p = 0; p < pieces.size(); ++p) {
+        uint32_t& crc = crcs[pieces[p].entry];
+        crc = checksum::crc32c_combine(crc, piece_crcs[p], pieces[p].length);
+    }
+    return crcs;
+}
+
+void GFSVerifier::write_sums(const fs::path& archive_path) const {
+    GFSView archive(archive_path);
+    std::vector<uint32_t> crcs = checksums(archive);
+    std::ostringstream sums;
+    sums << SUMS_MAGIC << ' ' << crcs.size() << '\n';
+    for (size_t e = 0; e < crcs.size(); ++e) {
+        const auto& entry = archive.entries()[e];
+        sums << std::hex << crcs[e] << std::dec << ' ' << entry.data_length << ' ' << entry.relative_path << '\n';
+    }
+    std::ofstream out(sums_path(archive_path), std::ios::binary | std::ios::trunc);
+    out << sums.str();
+    if (!out) {
+        throw std::runtime_error("Failed to write checksums: " + sums_path(archive_path).string());
+    }
+}
+
+GFSVerifier::Report GFSVerifier::check_sums(const fs::path& archive_path) const {
+    std::ifstream sums(sums_path(archive_path), std::ios::binary);
+    if (!sums) {
+        throw std::runtime_error("Failed to open checksums: " + sums_path(archive_path).string());
+    }
+    std::string line;
+    std::getline(sums, line);
+    std::istringstream header(line);
+    std::string magic, version;
+    uint64_t count{ 0 };
+    header >> magic >> version >> count;
+    if (header.fail() || magic + " " + version != SUMS_MAGIC) {
+        throw std::runtime_error("Not a checksum file: " + sums_path(archive_path).string());
+    }
+
+    GFSView archive(archive_path);
+    const auto& entries = archive.entries();
+    std::vector<uint32_t> crcs = checksums(archive);
+    Report report;
+    if (count != entries.size()) {
+        report.problems.push_back("Archive has " + std::to_string(entries.size()) + " files, the checksums list " + std::to_string(count));
+    }
+    for (size_t e = 0; e < entries.size() && std::getline(sums, line); ++e) {
+        std::istringstream fields(line);
+        std::string crc;
+        uint64_t size{ 0 };
+        fields >> crc >> size;
+        std::string relative_path;
+        if (fields.get() == ' ') {
+            std::getline(fields, relative_path);
+        }
+        if (fields.fail() || relative_path != entries[e].relative_path) {
+            report.problems.push_back("Unexpected file: " + std::string(entries[e].relative_path));
+            continue;
+        }
+        ++report.checked;
+        if (size != entries[e].data_length || (uint32_t)std::stoul(crc, nullptr, 16) != crcs[e]) {
+            report.problems.push_back("Damaged: " + relative_path);
+        }
+    }
+    return report;
+}
+
+GFSVerifier::Report GFSVerifier::compare_directory(const fs::path& archive_path, const fs::path& directory) const {
+    trace::scope phase("verify.compare");
+    GFSView archive(archive_path);
+    const auto& entries = archive.entries();
+    // Unpacking leaves the first entry of a duplicated path on disk
+    std::unordered_map<std::string_view, size_t> unpacked;
+    unpacked.reserve(entries.size());
+    for (size_t e = 0; e < entries.size(); ++e) {
+        unpacked.emplace(entries[e].relative_path, e);
+    }
+
+    Report report;
+    std::vector<file_io::read_request> requests;
+    std::vector<size_t> request_entry;
+    for (size_t e = 0; e < entries.size(); ++e) {
+        if (unpacked[entries[e].relative_path] != e) continue;
+        ++report.checked;
+        fs::path file_path = directory / fs::path(std::string(entries[e].relative_path));
+        file_path.make_preferred();
+        std::error_code ec;
+        uint64_t size = fs::file_size(file_path, ec);
+        if (ec) {
+            report.problems.push_back("Missing: " + std::string(entries[e].relative_path));
+        }
+        else if (size != entries[e].data_length) {
+            report.problems.push_back("Size differs: " + std::string(entries[e].relative_path));
+        }
+        else {
+            requests.push_back({ file_path, 0, size });
+            request_entry.push_back(e);
+        }
+    }
+
+    // Files are read by the reader threads and compared against the mapped
+    // archive as they arrive, nothing is copied out of the archive
+    std::vector<char> differs(requests.size(), 0);
+    file_io::read_in_order(requests, jobs, [&](size_t request, uint64_t offset, std::span<const unsigned char> data) {
+        if (differs[request] || data.empty()) return;
+        auto expected = archive.data(entries[request_entry[request]]).subspan((size_t)offset, data.size());
+        if (std::memcmp(expected.data(), data.data(), data.size()) != 0) {
+            differs[request] = 1;
+        }
+    });
+    for (size_t r = 0; r < requests.size(); ++r) {
+        if (differs[r]) {
+            report.problems.push_back("Content differs: " + std::string(entries[request_entry[r]].relative_path));
+        }
+    }
+
+    for (const auto& dir_entry : fs::recursive_directory_iterator(directory)) {
+        if (!dir_entry.is_regular_file()) continue;
+        std::string relative_path = fs::relative(dir_entry.path(), directory).generic_string();
+        if (unpacked.find(relative_path) == unpacked.end()) {
+            report.problems.push_back("Extra: " + relative_path);
+        }
+    }
+    return report;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "gfs.h"
+
+namespace fs = std::filesystem;
+
+// Integrity checks for archives and unpacked trees. Entries are checksummed
+// with CRC-32C in COPY_CHUNK_SIZE pieces on `jobs` threads (0 picks the
+// hardware concurrency), so a few big entries still use every core.
+class GFSVerifier {
+private:
+    unsigned jobs;
+public:
+    struct Report {
+        size_t checked{ 0 };
+        std::vector<std::string> problems; // one line per damaged, missing or extra file
+        bool ok() const { return problems.empty(); }
+    };
+    GFSVerifier(unsigned jobs = 1) : jobs(jobs) {}
+    // CRC-32C of every entry, in archive order
+    std::vector<uint32_t> checksums(const GFSView& archive) const;
+    // Writes the size and CRC-32C of every entry to sums_path(archive_path)
+    void write_sums(const fs::path& archive_path) const;
+    // Checks the archive against the file written by write_sums
+    Report check_sums(const fs::path& archive_path) const;
+    // Compares the files below directory with the entries they were unpacked
+    // from, byte for byte, and reports files the archive doesn't have
+    Report compare_directory(const fs::path& archive_path, const fs::path& directory) const;
+
+    // "<archive>.sums"
+    static fs::path sums_path(const fs::path& archive_path);
+};
@@ -5,10 +5,6 @@
 #include <algorithm>
 
 namespace reader {
-	uint32_t BE_readBuffer_VectorUnChar_to_UnInt32(std::vector<unsigned char>& buffer, size_t Start = 0);
-	uint32_t LE_readBuffer_VectorUnChar_to_UnInt32(std::vector<unsigned char>& buffer, size_t Start = 0);
-	uint64_t BE_readBuffer_VectorUnChar_to_UnInt64(std::vector<unsigned char>& buffer, size_t Start = 0);
-	uint64_t LE_readBuffer_VectorUnChar_to_UnInt64(std::vector<unsigned char>& buffer, size_t Start = 0);
 	std::string readBuffer_VectorUnChar_to_String(const std::vector<unsigned char>& buffer, size_t Start = 0, size_t SizeOfString = 0);
 }
 namespace writer {
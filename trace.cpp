@@ -0,0 +1,135 @@
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace trace {
+    std::atomic<bool> g_enabled{ false };
+
+    namespace {
+        struct event {
+            const char* name;
+            int64_t start;
+            int64_t end;
+        };
+        struct thread_buffer {
+            uint32_t id;
+            std::vector<event> events;
+            uint64_t counters[(size_t)counter::count_]{};
+        };
+
+        const char* const COUNTER_NAMES[(size_t)counter::count_]{
+            "bytes_read", "bytes_written", "bytes_cloned",
+            "open_calls", "read_calls", "write_calls", "clone_calls", "seek_calls"
+        };
+
+        // Buffers outlive their threads, worker pools end long before the dump
+        std::mutex g_buffers_mutex;
+        std::vector<std::unique_ptr<thread_buffer>> g_buffers;
+        std::chrono::steady_clock::time_point g_origin = std::chrono::steady_clock::now();
+
+        thread_buffer& local_buffer() {
+            thread_local thread_buffer* buffer = nullptr;
+            if (buffer == nullptr) {
+                std::lock_guard lock(g_buffers_mutex);
+                g_buffers.push_back(std::make_unique<thread_buffer>());
+                buffer = g_buffers.back().get();
+                buffer->id = (uint32_t)g_buffers.size();
+            }
+            return *buffer;
+        }
+    }
+
+    void enable() {
+        g_origin = std::chrono::steady_clock::now();
+        local_buffer(); // the enabling thread shows up first, as "main"
+        g_enabled.store(true, std::memory_order_relaxed);
+    }
+
+    void _add(counter which, uint64_t value) {
+        local_buffer().counters[(size_t)which] += value;
+    }
+
+    int64_t scope::_now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - g_origin).count();
+    }
+
+    void scope::_record(const char* name, int64_t start, int64_t end) {
+        local_buffer().events.push_back({ name, start, end });
+    }
+
+    void write_chrome_json(const fs::path& path) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Failed to create trace file: " + path.string());
+        }
+        std::lock_guard lock(g_buffers_mutex);
+        out << "{\"traceEvents\":[\n";
+        bool first = true;
+        auto separator = [&] {
+            if (!first) out << ",\n";
+            first = false;
+        };
+        int64_t last_time = 0;
+        for (const auto& buffer : g_buffers) {
+            separator();
+            out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->id
+                << ",\"args\":{\"name\":\"" << (buffer->id == 1 ? "main" : "worker " + std::to_string(buffer->id)) << "\"}}";
+            for (const auto& e : buffer->events) {
+                separator();
+                out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->id
+                    << ",\"ts\":" << e.start << ",\"dur\":" << e.end - e.start << "}";
+                last_time = std::max(last_time, e.end);
+            }
+        }
+        // Counter totals as one sample at the end of the trace
+        for (size_t c = 0; c < (size_t)counter::count_; ++c) {
+            uint64_t total = 0;
+            for (const auto& buffer : g_buffers) {
+                total += buffer->counters[c];
+            }
+            separator();
+            out << "{\"name\":\"" << COUNTER_NAMES[c] << "\",\"ph\":\"C\",\"pid\":1,\"ts\":" << last_time
+                << ",\"args\":{\"value\":" << total << "}}";
+        }
+        out << "\n]}\n";
+        if (!out) {
+            throw std::runtime_error("Failed to write trace file: " + path.string());
+        }
+    }
+
+    void print_stats(std::ostream& out) {
+        std::lock_guard lock(g_buffers_mutex);
+        struct phase_total {
+            uint64_t calls = 0;
+            int64_t micros = 0;
+        };
+        std::map<std::string, phase_total> phases;
+        uint64_t totals[(size_t)counter::count_]{};
+        for (const auto& buffer : g_buffers) {
+            for (const auto& e : buffer->events) {
+                auto& phase = phases[e.name];
+                ++phase.calls;
+                phase.micros += e.end - e.start;
+            }
+            for (size_t c = 0; c < (size_t)counter::count_; ++c) {
+                totals[c] += buffer->counters[c];
+            }
+        }
+        out << "Phases (summed over threads):\n";
+        for (const auto& [name, phase] : phases) {
+            out << "  " << name << ": " << phase.micros / 1000.0 << " ms in " << phase.calls << " call(s)\n";
+        }
+        out << "Counters:\n";
+        for (size_t c = 0; c < (size_t)counter::count_; ++c) {
+            out << "  " << COUNTER_NAMES[c] << ": " << totals[c] << '\n';
+        }
+        out << "Threads: " << g_buffers.size() << '\n';
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+
+namespace fs = std::filesystem;
+
+// Lightweight instrumentation: scoped phases and I/O counters, collected in
+// per-thread buffers. Nothing is recorded until enable() is called, so a
+// disabled scope or counter costs one relaxed atomic load.
+namespace trace {
+    enum class counter {
+        bytes_read,
+        bytes_written,
+        bytes_cloned,
+        open_calls,
+        read_calls,
+        write_calls,
+        clone_calls,
+        seek_calls,
+        count_
+    };
+
+    extern std::atomic<bool> g_enabled;
+
+    void enable();
+    inline bool enabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+    void _add(counter which, uint64_t value);
+    inline void add(counter which, uint64_t value = 1) {
+        if (enabled()) _add(which, value);
+    }
+
+    // Records the time between construction and destruction as one phase of
+    // the current thread. `name` must outlive the trace (a string literal).
+    class scope {
+    public:
+        explicit scope(const char* name) : m_name(enabled() ? name : nullptr) {
+            if (m_name) m_start = _now();
+        }
+        ~scope() {
+            if (m_name) _record(m_name, m_start, _now());
+        }
+        // Ends the current phase and starts the next one in its place
+        void next(const char* name) {
+            if (m_name) {
+                int64_t now = _now();
+                _record(m_name, m_start, now);
+                m_name = name;
+                m_start = now;
+            }
+        }
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+    private:
+        static int64_t _now();
+        static void _record(const char* name, int64_t start, int64_t end);
+        const char* m_name;
+        int64_t m_start{ 0 };
+    };
+
+    // Chrome trace-event JSON (chrome://tracing, Perfetto)
+    void write_chrome_json(const fs::path& path);
+    // Time per phase and counter totals
+    void print_stats(std::ostream& out);
+}